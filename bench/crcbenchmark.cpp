@@ -0,0 +1,84 @@
+#include <QElapsedTimer>
+#include <QStringList>
+
+#include <stdio.h>
+
+#include "crcbenchmark.h"
+#include "crc32mpeg2.h"
+
+static const int chunkSizes[] = { 32, 256, 1024 };
+
+// Straight from the definition, one bit of every little endian word at a time
+static uint32_t referenceUpdate(uint32_t crc, const char *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    for (; len >= 4; len -= 4, p += 4) {
+        crc ^= (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+
+        for (int i = 0; i < 32; i++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+
+    return crc;
+}
+
+CrcBenchmark::CrcBenchmark(qint64 size) :
+    data(size & ~3, Qt::Uninitialized)
+{
+    quint64 state = 0x9e3779b97f4a7c15ULL;
+    char *p = data.data();
+
+    for (qint64 i = 0; i < data.size(); i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        p[i] = state >> 56;
+    }
+}
+
+void CrcBenchmark::report(int chunkSize, const QString &implementation, qint64 msecs, bool ok)
+{
+    double seconds = msecs / 1000.0;
+
+    printf("%-8d %-12s %10.2f %10.1f %8s\n",
+           chunkSize, implementation.toUtf8().constData(), seconds,
+           seconds > 0 ? (double) data.size() / (1024 * 1024) / seconds : 0.0,
+           ok ? "ok" : "MISMATCH");
+}
+
+bool CrcBenchmark::run()
+{
+    QElapsedTimer timer;
+    QString initialBackend = Crc32Mpeg2::backend();
+    bool ok = true;
+
+    printf("%-8s %-12s %10s %10s %8s\n", "chunk", "crc", "time s", "MiB/s", "result");
+
+    for (int chunkSize : chunkSizes) {
+        uint32_t expected = Crc32Mpeg2::initialValue;
+
+        timer.start();
+
+        for (qint64 pos = 0; pos < data.size(); pos += chunkSize)
+            expected = referenceUpdate(expected, data.constData() + pos, qMin((qint64) chunkSize, data.size() - pos));
+
+        report(chunkSize, "bitwise", timer.elapsed(), true);
+
+        foreach (const QString &backend, Crc32Mpeg2::availableBackends()) {
+            uint32_t crc = Crc32Mpeg2::initialValue;
+
+            Crc32Mpeg2::setBackend(backend);
+            timer.restart();
+
+            for (qint64 pos = 0; pos < data.size(); pos += chunkSize)
+                crc = Crc32Mpeg2::update(crc, data.constData() + pos, qMin((qint64) chunkSize, data.size() - pos));
+
+            bool match = crc == expected;
+            report(chunkSize, backend, timer.elapsed(), match);
+            ok &= match;
+        }
+    }
+
+    Crc32Mpeg2::setBackend(initialBackend);
+
+    return ok;
+}
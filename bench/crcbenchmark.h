@@ -0,0 +1,22 @@
+#pragma once
+
+#include <QByteArray>
+
+//
+// Compares the CRC32-MPEG2 backends the CPU supports with a bit at a time
+// reference, chaining the CRC over chunks of the sizes Fring firmware updates
+// are pushed in.
+//
+
+class CrcBenchmark
+{
+public:
+    explicit CrcBenchmark(qint64 size);
+
+    bool run();
+
+private:
+    QByteArray data;
+
+    void report(int chunkSize, const QString &implementation, qint64 msecs, bool ok);
+};
@@ -0,0 +1,107 @@
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QLoggingCategory>
+#include <QTemporaryFile>
+
+#include <stdio.h>
+
+#include "fringbenchmark.h"
+#include "simulatedfring.h"
+
+FringBenchmark::FringBenchmark(qint64 size) :
+    data(size, Qt::Uninitialized)
+{
+    quint64 state = 0x9e3779b97f4a7c15ULL;
+    char *p = data.data();
+
+    for (qint64 i = 0; i < size; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        p[i] = state >> 56;
+    }
+}
+
+void FringBenchmark::report(SimulatedFring *fring, qint64 msecs, bool ok)
+{
+    double seconds = msecs / 1000.0;
+
+    printf("%-8d %8d %8d %10.2f %10.1f %8s\n",
+           fring->protocolVersion, fring->updateChunkSize, fring->updateWindow, seconds,
+           seconds > 0 ? (double) data.size() / 1024 / seconds : 0.0,
+           ok ? "ok" : "FAILED");
+}
+
+bool FringBenchmark::push(SimulatedFring *fring, const QString &fileName, qint64 *msecs)
+{
+    QElapsedTimer timer;
+    QEventLoop loop;
+    bool succeeded = false;
+
+    if (!fring->negotiateProtocol())
+        return false;
+
+    timer.start();
+    fring->startFirmwareUpdate(fileName);
+
+    FringUpdateThread *thread = fring->updateThread;
+
+    // Both are queued from the update thread, so succeeded is seen first
+    QObject::connect(thread, &FringUpdateThread::succeeded, &loop, [&succeeded]() {
+        succeeded = true;
+    }, Qt::QueuedConnection);
+    QObject::connect(thread, &QThread::finished, &loop, &QEventLoop::quit, Qt::QueuedConnection);
+
+    if (!thread->isFinished())
+        loop.exec();
+
+    thread->wait();
+    *msecs = timer.elapsed();
+
+    return succeeded && fring->flashedImage() == data;
+}
+
+bool FringBenchmark::run()
+{
+    QTemporaryFile file;
+    bool ok = true;
+
+    // Progress is logged for every percent
+    QLoggingCategory::setFilterRules("Fring.info=false\nGPIO.warning=false");
+
+    if (!file.open() || file.write(data) != data.size() || !file.flush()) {
+        fprintf(stderr, "Unable to write firmware image\n");
+        return false;
+    }
+
+    printf("%-8s %8s %8s %10s %10s %8s\n", "protocol", "chunk", "window", "time s", "KiB/s", "result");
+
+    // Version 1 firmware, which the host falls back to
+    {
+        SimulatedFring fring(FringProtocol::FRING_PROTOCOL_VERSION_1, 32, 1);
+        qint64 msecs = 0;
+        bool pushed = push(&fring, file.fileName(), &msecs);
+
+        report(&fring, msecs, pushed);
+        ok &= pushed;
+    }
+
+    {
+        SimulatedFring fring(FringProtocol::FRING_PROTOCOL_VERSION_2, 256, 8);
+        qint64 msecs = 0;
+        bool pushed = push(&fring, file.fileName(), &msecs);
+
+        report(&fring, msecs, pushed);
+        ok &= pushed;
+    }
+
+    // Version 3 firmware, whose interrupts are serviced with a status burst
+    {
+        SimulatedFring fring(FringProtocol::FRING_PROTOCOL_VERSION_3, 256, 8);
+        qint64 msecs = 0;
+        bool pushed = push(&fring, file.fileName(), &msecs);
+
+        report(&fring, msecs, pushed);
+        ok &= pushed;
+    }
+
+    return ok;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+
+class SimulatedFring;
+
+//
+// Pushes a firmware image to a SimulatedFring the way Fring updates its
+// microcontroller: to firmware that only speaks protocol version 1, to
+// firmware that negotiates larger chunks and a window of outstanding ones, and
+// to firmware that also reports its interrupts in a checksummed status burst.
+// The image the simulation flashed is compared with the one pushed.
+//
+
+class FringBenchmark
+{
+public:
+    explicit FringBenchmark(qint64 size);
+
+    bool run();
+
+private:
+    QByteArray data;
+
+    bool push(SimulatedFring *fring, const QString &fileName, qint64 *msecs);
+    void report(SimulatedFring *fring, qint64 msecs, bool ok);
+};
@@ -0,0 +1,99 @@
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QVector>
+
+#include <stdio.h>
+
+#include "hashbenchmark.h"
+#include "sha512.h"
+
+static const qint64 sliceSize = 1024 * 1024;
+static const qint64 blockSize = 4096;
+
+HashBenchmark::HashBenchmark(qint64 size) :
+    data(size, Qt::Uninitialized)
+{
+    quint64 state = 0x9e3779b97f4a7c15ULL;
+    char *p = data.data();
+
+    for (qint64 i = 0; i < size; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        p[i] = state >> 56;
+    }
+}
+
+void HashBenchmark::report(const QString &test, const QString &implementation, qint64 msecs, bool ok)
+{
+    double seconds = msecs / 1000.0;
+
+    printf("%-8s %-12s %10.2f %10.1f %8s\n",
+           test.toUtf8().constData(), implementation.toUtf8().constData(), seconds,
+           seconds > 0 ? (double) data.size() / (1024 * 1024) / seconds : 0.0,
+           ok ? "ok" : "MISMATCH");
+}
+
+bool HashBenchmark::run()
+{
+    QElapsedTimer timer;
+    QString initialBackend = Sha512::backend();
+    bool ok = true;
+
+    printf("%-8s %-12s %10s %10s %8s\n", "test", "hash", "time s", "MiB/s", "result");
+
+    // One stream in slices
+    timer.start();
+
+    QCryptographicHash qtHash(QCryptographicHash::Sha512);
+    for (qint64 pos = 0; pos < data.size(); pos += sliceSize)
+        qtHash.addData(data.constData() + pos, qMin(sliceSize, data.size() - pos));
+
+    QByteArray expected = qtHash.result();
+    report("stream", "qt", timer.elapsed(), true);
+
+    foreach (const QString &backend, Sha512::availableBackends()) {
+        Sha512::setBackend(backend);
+        timer.restart();
+
+        Sha512 hash;
+        for (qint64 pos = 0; pos < data.size(); pos += sliceSize)
+            hash.addData(data.constData() + pos, qMin(sliceSize, data.size() - pos));
+
+        bool match = hash.result() == expected;
+        report("stream", backend, timer.elapsed(), match);
+        ok &= match;
+    }
+
+    // Independent blocks
+    int numBlocks = data.size() / blockSize;
+    QVector<const char *> blocks(numBlocks);
+    QVector<QByteArray> expectedDigests(numBlocks);
+
+    for (int i = 0; i < numBlocks; i++)
+        blocks[i] = data.constData() + i * blockSize;
+
+    timer.restart();
+
+    for (int i = 0; i < numBlocks; i++)
+        expectedDigests[i] = QCryptographicHash::hash(QByteArray::fromRawData(blocks[i], blockSize),
+                                                      QCryptographicHash::Sha512);
+
+    report("blocks", "qt", timer.elapsed(), true);
+
+    foreach (const QString &backend, Sha512::availableBackends()) {
+        QVector<QByteArray> digests(numBlocks);
+
+        Sha512::setBackend(backend);
+        timer.restart();
+
+        Sha512::hashMany(blocks.constData(), numBlocks, blockSize, digests.data());
+
+        bool match = digests == expectedDigests;
+        report("blocks", backend, timer.elapsed(), match);
+        ok &= match;
+    }
+
+    Sha512::setBackend(initialBackend);
+
+    return ok;
+}
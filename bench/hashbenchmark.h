@@ -0,0 +1,22 @@
+#pragma once
+
+#include <QByteArray>
+
+//
+// Compares SHA512 throughput of QCryptographicHash with every Sha512 backend
+// the CPU supports, both for one stream hashed in 1 MiB slices as image
+// verification does, and for many 4 KiB blocks as block map scans do.
+//
+
+class HashBenchmark
+{
+public:
+    explicit HashBenchmark(qint64 size);
+
+    bool run();
+
+private:
+    QByteArray data;
+
+    void report(const QString &test, const QString &implementation, qint64 msecs, bool ok);
+};
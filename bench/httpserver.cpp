@@ -0,0 +1,190 @@
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QFileInfo>
+#include <QDebug>
+
+#include <fcntl.h>
+
+#include "httpserver.h"
+
+const qint64 HttpConnection::pieceSize;
+
+HttpServer::HttpServer(const QString &root, QObject *parent) :
+    QThread(parent), root(root), port(0), ready()
+{
+}
+
+HttpServer::~HttpServer()
+{
+    quit();
+    wait();
+}
+
+bool HttpServer::startServer()
+{
+    start();
+    ready.acquire();
+
+    return port != 0;
+}
+
+QUrl HttpServer::url(const QString &fileName) const
+{
+    return QUrl(QString("http://127.0.0.1:%1/%2").arg(port).arg(fileName));
+}
+
+void HttpServer::run()
+{
+    QTcpServer server;
+
+    QObject::connect(&server, &QTcpServer::newConnection, [this, &server]() {
+        while (server.hasPendingConnections())
+            new HttpConnection(server.nextPendingConnection(), root, &server);
+    });
+
+    if (server.listen(QHostAddress::LocalHost, 0))
+        port = server.serverPort();
+    else
+        qWarning() << "Unable to listen:" << server.errorString();
+
+    ready.release();
+
+    if (port != 0)
+        exec();
+}
+
+HttpConnection::HttpConnection(QTcpSocket *socket, const QString &root, QObject *parent) :
+    QObject(parent),
+    socket(socket),
+    root(root),
+    position(0),
+    remaining(0)
+{
+    socket->setParent(this);
+
+    connect(socket, &QTcpSocket::readyRead, this, &HttpConnection::readRequest);
+    connect(socket, &QTcpSocket::bytesWritten, this, &HttpConnection::sendBody);
+    connect(socket, &QTcpSocket::disconnected, this, &QObject::deleteLater);
+}
+
+void HttpConnection::readRequest()
+{
+    buffer += socket->readAll();
+
+    // Requests on a keep-alive connection are answered one after another
+    while (!file.isOpen()) {
+        int end = buffer.indexOf("\r\n\r\n");
+        if (end < 0)
+            return;
+
+        QByteArray header = buffer.left(end);
+        buffer.remove(0, end + 4);
+
+        startResponse(header);
+    }
+}
+
+void HttpConnection::sendHeader(int status, const QByteArray &reason, const QList<QByteArray> &fields)
+{
+    QByteArray header = "HTTP/1.1 " + QByteArray::number(status) + " " + reason + "\r\n";
+
+    foreach (const QByteArray &field, fields)
+        header += field + "\r\n";
+
+    socket->write(header + "\r\n");
+}
+
+void HttpConnection::startResponse(const QByteArray &header)
+{
+    QList<QByteArray> lines = header.split('\n');
+    QList<QByteArray> request = lines.takeFirst().trimmed().split(' ');
+    QByteArray range;
+
+    foreach (const QByteArray &line, lines) {
+        int colon = line.indexOf(':');
+        if (colon > 0 && line.left(colon).trimmed().toLower() == "range")
+            range = line.mid(colon + 1).trimmed();
+    }
+
+    QString name = request.size() > 1 ? QString::fromUtf8(request[1]).section('?', 0, 0) : QString();
+    QFileInfo info(root + name);
+
+    if (request.value(0) != "GET" || name.contains("..") || !info.isFile()) {
+        sendHeader(404, "Not Found", QList<QByteArray>() << "Content-Length: 0");
+        return;
+    }
+
+    qint64 size = info.size();
+    qint64 first = 0, last = size - 1;
+    bool partial = false;
+
+    if (range.startsWith("bytes=")) {
+        QList<QByteArray> bounds = range.mid(6).split('-');
+
+        first = bounds.value(0).toLongLong();
+        if (!bounds.value(1).isEmpty())
+            last = qMin(bounds.value(1).toLongLong(), size - 1);
+
+        if (first > last || first >= size) {
+            sendHeader(416, "Range Not Satisfiable",
+                       QList<QByteArray>() << "Content-Length: 0"
+                                           << "Content-Range: bytes */" + QByteArray::number(size));
+            return;
+        }
+
+        partial = true;
+    }
+
+    file.setFileName(info.filePath());
+    if (!file.open(QFile::ReadOnly)) {
+        sendHeader(500, "Internal Server Error", QList<QByteArray>() << "Content-Length: 0");
+        return;
+    }
+
+    position = first;
+    remaining = last - first + 1;
+
+    QList<QByteArray> fields;
+    fields << "Content-Type: application/octet-stream"
+           << "Accept-Ranges: bytes"
+           << "Content-Length: " + QByteArray::number(remaining);
+
+    if (partial) {
+        fields << "Content-Range: bytes " + QByteArray::number(first) + "-" +
+                  QByteArray::number(last) + "/" + QByteArray::number(size);
+        sendHeader(206, "Partial Content", fields);
+    } else {
+        sendHeader(200, "OK", fields);
+    }
+
+    sendBody();
+}
+
+void HttpConnection::sendBody()
+{
+    if (!file.isOpen())
+        return;
+
+    while (remaining > 0 && socket->bytesToWrite() < 4 * HttpConnection::pieceSize) {
+        QByteArray piece(qMin(remaining, HttpConnection::pieceSize), Qt::Uninitialized);
+
+        if (!file.seek(position) || file.read(piece.data(), piece.size()) != piece.size()) {
+            socket->abort();
+            return;
+        }
+
+        posix_fadvise(file.handle(), position, piece.size(), POSIX_FADV_DONTNEED);
+
+        socket->write(piece);
+        position += piece.size();
+        remaining -= piece.size();
+    }
+
+    if (remaining == 0) {
+        file.close();
+
+        // Continue with pipelined requests
+        if (!buffer.isEmpty())
+            readRequest();
+    }
+}
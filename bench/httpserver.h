@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QObject>
+#include <QThread>
+#include <QSemaphore>
+#include <QFile>
+#include <QUrl>
+
+class QTcpSocket;
+
+//
+// Minimal HTTP/1.1 server that serves the files of a directory, including
+// single range requests. It runs an event loop in its own thread, so it keeps
+// serving while the code under test blocks. Bodies are streamed from disk in
+// small pieces, and served data is dropped from the page cache again, so the
+// server doesn't distort memory and cache figures of the benchmark.
+//
+
+class HttpServer : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit HttpServer(const QString &root, QObject *parent = 0);
+    ~HttpServer();
+
+    bool startServer();
+    QUrl url(const QString &fileName) const;
+
+protected:
+    void run() Q_DECL_OVERRIDE;
+
+private:
+    QString root;
+    quint16 port;
+    QSemaphore ready;
+};
+
+class HttpConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    HttpConnection(QTcpSocket *socket, const QString &root, QObject *parent = 0);
+
+private slots:
+    void readRequest();
+    void sendBody();
+
+private:
+    static const qint64 pieceSize = 256 * 1024;
+
+    QTcpSocket *socket;
+    QString root;
+    QByteArray buffer;
+    QFile file;
+    qint64 position;
+    qint64 remaining;
+
+    void startResponse(const QByteArray &header);
+    void sendHeader(int status, const QByteArray &reason, const QList<QByteArray> &fields);
+};
@@ -0,0 +1,80 @@
+QT += core network dbus
+QT -= gui
+
+CONFIG += c++11
+
+TARGET = kalami-bench
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_NO_DEBUG_OUTPUT
+
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    updatebenchmark.cpp \
+    hashbenchmark.cpp \
+    crcbenchmark.cpp \
+    httpserver.cpp \
+    loopdevice.cpp \
+    fringbenchmark.cpp \
+    simulatedfring.cpp \
+    ../updater.cpp \
+    ../machine.cpp \
+    ../gptparser.cpp \
+    ../imagereader.cpp \
+    ../blockdevice.cpp \
+    ../imagepipeline.cpp \
+    ../vcdiffoutput.cpp \
+    ../sha512.cpp \
+    ../downloadjournal.cpp \
+    ../chunkeddownloader.cpp \
+    ../blockupdater.cpp \
+    ../iothrottler.cpp \
+    ../iouring.cpp \
+    ../treeverifier.cpp \
+    ../signatureverifier.cpp \
+    ../manifestcache.cpp \
+    ../deltaplanner.cpp \
+    ../streaminflater.cpp \
+    ../fring.cpp \
+    ../i2cclient.cpp \
+    ../gpio.cpp \
+    ../crc32mpeg2.cpp
+
+HEADERS += \
+    updatebenchmark.h \
+    hashbenchmark.h \
+    crcbenchmark.h \
+    httpserver.h \
+    loopdevice.h \
+    fringbenchmark.h \
+    simulatedfring.h \
+    ../updater.h \
+    ../machine.h \
+    ../gptparser.h \
+    ../imagereader.h \
+    ../blockdevice.h \
+    ../imagepipeline.h \
+    ../vcdiffoutput.h \
+    ../sha512.h \
+    ../downloadjournal.h \
+    ../chunkeddownloader.h \
+    ../blockupdater.h \
+    ../iothrottler.h \
+    ../iouring.h \
+    ../treeverifier.h \
+    ../signatureverifier.h \
+    ../manifestcache.h \
+    ../deltaplanner.h \
+    ../streaminflater.h \
+    ../fring.h \
+    ../fring-protocol.h \
+    ../crc32mpeg2.h \
+    ../i2cclient.h \
+    ../gpio.h
+
+LIBS += -lvcdenc -lvcddec -lvcdcom
+LIBS += -lcrypto -lz
@@ -0,0 +1,81 @@
+#include <QDebug>
+
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "loopdevice.h"
+
+LoopDevice::LoopDevice() : fd(-1)
+{
+}
+
+LoopDevice::~LoopDevice()
+{
+    detach();
+}
+
+bool LoopDevice::attach(const QString &backingFile)
+{
+    int control = ::open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (control < 0) {
+        qWarning() << "Unable to open /dev/loop-control:" << strerror(errno);
+        return false;
+    }
+
+    int backing = ::open(backingFile.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
+    if (backing < 0) {
+        qWarning() << "Unable to open" << backingFile << ":" << strerror(errno);
+        ::close(control);
+        return false;
+    }
+
+    // Another process may grab the free device before us, so retry a few times
+    for (int attempt = 0; attempt < 8 && fd < 0; attempt++) {
+        int n = ioctl(control, LOOP_CTL_GET_FREE);
+        if (n < 0)
+            break;
+
+        QString path = QString("/dev/loop%1").arg(n);
+        int loop = ::open(path.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
+        if (loop < 0)
+            continue;
+
+        if (ioctl(loop, LOOP_SET_FD, backing) < 0) {
+            ::close(loop);
+            continue;
+        }
+
+        // Avoid caching everything twice, once for the loop device and once
+        // for the backing file. Older kernels don't support this.
+        ioctl(loop, LOOP_SET_DIRECT_IO, 1UL);
+
+        fd = loop;
+        devicePath = path;
+    }
+
+    ::close(backing);
+    ::close(control);
+
+    if (fd < 0) {
+        qWarning() << "Unable to attach" << backingFile << "to a loop device";
+        return false;
+    }
+
+    return true;
+}
+
+void LoopDevice::detach()
+{
+    if (fd < 0)
+        return;
+
+    ioctl(fd, LOOP_CLR_FD, 0);
+    ::close(fd);
+
+    fd = -1;
+    devicePath.clear();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <QString>
+
+//
+// Attaches a regular file to a free loop device, so it can stand in for a
+// partition. The device is detached again when the object is destroyed.
+//
+
+class LoopDevice
+{
+public:
+    LoopDevice();
+    ~LoopDevice();
+
+    bool attach(const QString &backingFile);
+    void detach();
+    const QString &path() const { return devicePath; }
+
+private:
+    int fd;
+    QString devicePath;
+};
@@ -0,0 +1,104 @@
+#include <QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCommandLineOption>
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include "updatebenchmark.h"
+#include "hashbenchmark.h"
+#include "crcbenchmark.h"
+#include "fringbenchmark.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+
+    parser.setApplicationDescription("Benchmark for the kalami update path");
+    parser.addHelpOption();
+
+    QCommandLineOption backendOption("backend", "Stand-in partitions: loop, file or memory",
+                                     QStringLiteral("backend"), QStringLiteral("loop"));
+    QCommandLineOption workDirOption("workdir", "Directory for stand-in partitions and served images",
+                                     QStringLiteral("dir"), QStringLiteral("/var/tmp"));
+    QCommandLineOption bootSizeOption("boot-size", "Size of the boot image in MiB",
+                                      QStringLiteral("size"), QStringLiteral("16"));
+    QCommandLineOption rootfsSizeOption("rootfs-size", "Size of the rootfs image in MiB",
+                                        QStringLiteral("size"), QStringLiteral("256"));
+    QCommandLineOption changeOption("change", "Percentage of blocks that differ between seed and update",
+                                    QStringLiteral("percent"), QStringLiteral("5"));
+    QCommandLineOption dirtyLimitOption("dirty-limit", "Dirty page cache in MiB a delta decode may accumulate, 0 for no limit",
+                                        QStringLiteral("size"), QStringLiteral("16"));
+    QCommandLineOption hashOption("hash", "Only compare SHA512 implementations, over the given number of MiB",
+                                  QStringLiteral("size"));
+    QCommandLineOption crcOption("crc", "Only compare CRC32-MPEG2 implementations, over the given number of MiB",
+                                 QStringLiteral("size"));
+    QCommandLineOption fringOption("fring", "Only push a firmware image of the given number of KiB to a simulated Fring",
+                                   QStringLiteral("size"));
+    QCommandLineOption keepCachesOption("keep-caches", "Don't drop the page cache before every phase");
+
+    parser.addOption(backendOption);
+    parser.addOption(workDirOption);
+    parser.addOption(bootSizeOption);
+    parser.addOption(rootfsSizeOption);
+    parser.addOption(changeOption);
+    parser.addOption(dirtyLimitOption);
+    parser.addOption(keepCachesOption);
+    parser.addOption(hashOption);
+    parser.addOption(crcOption);
+    parser.addOption(fringOption);
+    parser.process(app);
+
+    if (parser.isSet(hashOption)) {
+        HashBenchmark benchmark(parser.value(hashOption).toLongLong() * 1024 * 1024);
+
+        return benchmark.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (parser.isSet(crcOption)) {
+        CrcBenchmark benchmark(parser.value(crcOption).toLongLong() * 1024 * 1024);
+
+        return benchmark.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (parser.isSet(fringOption)) {
+        FringBenchmark benchmark(parser.value(fringOption).toLongLong() * 1024);
+
+        return benchmark.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    UpdateBenchmark::Options options;
+
+    if (parser.value(backendOption) == "loop") {
+        options.backend = UpdateBenchmark::LoopBackend;
+    } else if (parser.value(backendOption) == "file") {
+        options.backend = UpdateBenchmark::FileBackend;
+    } else if (parser.value(backendOption) == "memory") {
+        options.backend = UpdateBenchmark::MemoryBackend;
+    } else {
+        fprintf(stderr, "Unknown backend %s\n", parser.value(backendOption).toUtf8().constData());
+        return EXIT_FAILURE;
+    }
+
+    if (options.backend == UpdateBenchmark::LoopBackend && geteuid() != 0) {
+        fprintf(stderr, "Loop devices can only be set up by root, use --backend file instead\n");
+        return EXIT_FAILURE;
+    }
+
+    options.workDir = parser.value(workDirOption);
+    options.bootSize = parser.value(bootSizeOption).toLongLong() * 1024 * 1024;
+    options.rootfsSize = parser.value(rootfsSizeOption).toLongLong() * 1024 * 1024;
+    options.changePercent = parser.value(changeOption).toInt();
+    options.dirtyLimit = parser.value(dirtyLimitOption).toLongLong() * 1024 * 1024;
+    options.dropCaches = !parser.isSet(keepCachesOption);
+
+    if (options.bootSize <= 0 || options.rootfsSize <= 0) {
+        fprintf(stderr, "Invalid image size\n");
+        return EXIT_FAILURE;
+    }
+
+    UpdateBenchmark benchmark(options);
+
+    return benchmark.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,216 @@
+#include <QtEndian>
+#include <QMutexLocker>
+#include <QTimer>
+
+#include <string.h>
+
+#include "simulatedfring.h"
+#include "crc32mpeg2.h"
+
+// 9 clock cycles per byte on a 400 kHz bus
+static const unsigned long byteTimeUs = 23;
+
+// Flash programming, per chunk and per byte
+static const unsigned long flashChunkUs = 200;
+static const unsigned long flashByteUs = 4;
+
+// GPIO edge to slot invocation
+static const int irqLatencyMs = 1;
+
+static const int chunkSizeV1 = 32;
+
+SimulatedFring::SimulatedFring(int protocolVersion, int maxChunkSize, int window, QObject *parent) :
+    Fring(parent),
+    firmwareProtocolVersion(protocolVersion),
+    maxChunkSize(maxChunkSize),
+    window(window),
+    activeProtocolVersion(FringProtocol::FRING_PROTOCOL_VERSION_1),
+    expectedOffset(0),
+    expectedCRC(Crc32Mpeg2::initialValue),
+    completedChunks(0),
+    updateResult(FringProtocol::FRING_UPDATE_RESULT_OK),
+    interruptPending(false),
+    stopping(false),
+    firmware(this)
+{
+    QObject::connect(this, &SimulatedFring::interruptRaised, this, [this]() {
+        QTimer::singleShot(irqLatencyMs, this, [this]() {
+            onInterrupt(GPIO::ValueLo);
+        });
+    }, Qt::QueuedConnection);
+
+    firmware.start();
+}
+
+SimulatedFring::~SimulatedFring()
+{
+    mutex.lock();
+    stopping = true;
+    chunkQueued.wakeAll();
+    mutex.unlock();
+
+    firmware.wait();
+}
+
+QByteArray SimulatedFring::flashedImage()
+{
+    QMutexLocker locker(&mutex);
+
+    return image;
+}
+
+void SimulatedFring::raiseInterrupt()
+{
+    if (interruptPending)
+        return;
+
+    interruptPending = true;
+    emit interruptRaised();
+}
+
+void SimulatedFring::pushChunk(const FringProtocol::CommandWrite *wrCmd, size_t wrSize)
+{
+    const FringProtocol::FirmwareUpdate &update = wrCmd->firmwareUpdate;
+    size_t headerSize = offsetof(FringProtocol::CommandWrite, firmwareUpdate) + sizeof(update);
+    uint32_t length = qFromLittleEndian(update.length);
+    uint32_t offset = qFromLittleEndian(update.offset);
+    bool windowed = activeProtocolVersion >= FringProtocol::FRING_PROTOCOL_VERSION_2;
+    size_t chunkSize = windowed ? maxChunkSize : chunkSizeV1;
+
+    if (updateResult != FringProtocol::FRING_UPDATE_RESULT_OK)
+        return;
+
+    bool valid = length <= chunkSize && length % 4 == 0 && offset == expectedOffset;
+
+    // Version 1 firmware only takes full sized transfers, one at a time
+    if (windowed)
+        valid &= wrSize == headerSize + length && pendingChunks.size() < window;
+    else
+        valid &= wrSize == headerSize + chunkSize && pendingChunks.isEmpty();
+
+    if (!valid) {
+        updateResult = FringProtocol::FRING_UPDATE_RESULT_INVAL;
+        raiseInterrupt();
+        return;
+    }
+
+    uint32_t crc = Crc32Mpeg2::update(expectedCRC, update.payload, length);
+    if (crc != qFromLittleEndian(update.crc)) {
+        updateResult = FringProtocol::FRING_UPDATE_RESULT_CRC_ERR;
+        raiseInterrupt();
+        return;
+    }
+
+    expectedCRC = crc;
+    expectedOffset += length;
+    pendingChunks.enqueue(QByteArray(update.payload, length));
+    chunkQueued.wakeOne();
+}
+
+bool SimulatedFring::transfer(const FringProtocol::CommandWrite *wrCmd, size_t wrSize,
+                              const FringProtocol::CommandRead *rdCmd, size_t rdSize)
+{
+    FringProtocol::CommandRead reply;
+    QMutexLocker busLocker(&busMutex);
+
+    // Address, written bytes, repeated start and at least one byte read back
+    QThread::usleep((2 + wrSize + 1 + qMax(rdSize, (size_t) 1)) * byteTimeUs);
+
+    memset(&reply, 0, sizeof(reply));
+
+    QMutexLocker locker(&mutex);
+
+    switch (wrCmd->reg) {
+    case FringProtocol::FRING_REG_ID:
+        memcpy(reply.protocolInfo.id, "Fring", sizeof(reply.protocolInfo.id));
+
+        if (firmwareProtocolVersion >= FringProtocol::FRING_PROTOCOL_VERSION_2 &&
+                wrCmd->protocol.version >= FringProtocol::FRING_PROTOCOL_VERSION_2) {
+            activeProtocolVersion = qMin(firmwareProtocolVersion, (int) wrCmd->protocol.version);
+            reply.protocolInfo.version = activeProtocolVersion;
+            reply.protocolInfo.maxChunkSize = qToLittleEndian<uint16_t>(maxChunkSize);
+            reply.protocolInfo.window = window;
+        } else {
+            // Version 1 firmware stops answering after the Id
+            activeProtocolVersion = FringProtocol::FRING_PROTOCOL_VERSION_1;
+            memset((char *) &reply + sizeof(reply.id), 0xff, sizeof(reply) - sizeof(reply.id));
+        }
+
+        pendingChunks.clear();
+        image.clear();
+        expectedOffset = 0;
+        expectedCRC = Crc32Mpeg2::initialValue;
+        completedChunks = 0;
+        updateResult = FringProtocol::FRING_UPDATE_RESULT_OK;
+        break;
+
+    case FringProtocol::FRING_REG_READ_INTERRUPT_STATUS:
+        if (interruptPending)
+            reply.interruptStatus.status = qToLittleEndian<uint32_t>(FringProtocol::FRING_INTERRUPT_FIRMWARE_UPDATE);
+
+        interruptPending = false;
+        break;
+
+    case FringProtocol::FRING_REG_READ_STATUS:
+        if (activeProtocolVersion < FringProtocol::FRING_PROTOCOL_VERSION_3)
+            break;
+
+        reply.status.version = FringProtocol::FRING_STATUS_VERSION_1;
+
+        if (interruptPending)
+            reply.status.interruptStatus.status = qToLittleEndian<uint32_t>(FringProtocol::FRING_INTERRUPT_FIRMWARE_UPDATE);
+
+        reply.status.crc = qToLittleEndian(Crc32Mpeg2::checksum((const char *) &reply.status,
+                                                                offsetof(FringProtocol::Status, crc)));
+        interruptPending = false;
+        break;
+
+    case FringProtocol::FRING_REG_PUSH_FIRMWARE_UPDATE:
+        pushChunk(wrCmd, wrSize);
+        break;
+
+    case FringProtocol::FRING_REG_READ_FIRMWARE_UPDATE_RESULT:
+        if (activeProtocolVersion >= FringProtocol::FRING_PROTOCOL_VERSION_2) {
+            reply.updateAck.status = qToLittleEndian(updateResult);
+            reply.updateAck.chunks = qToLittleEndian(completedChunks);
+        } else {
+            reply.updateStatus.status = qToLittleEndian(updateResult);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (rdCmd)
+        memcpy((void *) rdCmd, &reply, qMin(rdSize, sizeof(reply)));
+
+    return true;
+}
+
+void SimulatedFring::Firmware::run()
+{
+    QMutexLocker locker(&fring->mutex);
+
+    forever {
+        while (fring->pendingChunks.isEmpty() && !fring->stopping)
+            fring->chunkQueued.wait(&fring->mutex);
+
+        if (fring->stopping)
+            return;
+
+        // The chunk keeps its slot in the window until it is flashed
+        size_t length = fring->pendingChunks.head().size();
+
+        locker.unlock();
+        QThread::usleep(flashChunkUs + length * flashByteUs);
+        locker.relock();
+
+        if (fring->pendingChunks.isEmpty())
+            continue;
+
+        fring->image.append(fring->pendingChunks.dequeue());
+        fring->completedChunks++;
+        fring->raiseInterrupt();
+    }
+}
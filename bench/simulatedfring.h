@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QByteArray>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "fring.h"
+
+//
+// SimulatedFring stands in for the Fring microcontroller on the host side of
+// the I2C bus. Transfers take the time they would on a 400 kHz bus, and the
+// firmware answers the registers involved in a firmware update. Pushed chunks
+// are checked for their offset and CRC and flashed by a worker thread, which
+// raises the interrupt line once they are done. The interrupt reaches the
+// host with the latency of a GPIO edge going through the event loop.
+//
+// protocolVersion selects the firmware the simulation behaves like. Version 1
+// firmware answers FRING_REG_ID with a bare Id and acknowledges every chunk on
+// its own. Version 3 firmware also answers the FRING_REG_READ_STATUS burst,
+// checksummed like the real one.
+//
+
+class SimulatedFring : public Fring
+{
+    Q_OBJECT
+
+public:
+    SimulatedFring(int protocolVersion, int maxChunkSize, int window, QObject *parent = 0);
+    ~SimulatedFring();
+
+    QByteArray flashedImage();
+
+signals:
+    void interruptRaised();
+
+protected:
+    bool transfer(const FringProtocol::CommandWrite *wrCmd, size_t wrSize,
+                  const FringProtocol::CommandRead *rdCmd = 0, size_t rdSize = 0) Q_DECL_OVERRIDE;
+
+private:
+    class Firmware : public QThread
+    {
+    public:
+        explicit Firmware(SimulatedFring *fring) : fring(fring) {}
+        void run() Q_DECL_OVERRIDE;
+
+    private:
+        SimulatedFring *fring;
+    };
+
+    friend class Firmware;
+
+    const int firmwareProtocolVersion;
+    const int maxChunkSize;
+    const int window;
+
+    QMutex busMutex;
+
+    QMutex mutex;
+    QWaitCondition chunkQueued;
+    int activeProtocolVersion;
+    QQueue<QByteArray> pendingChunks;
+    QByteArray image;
+    uint32_t expectedOffset;
+    uint32_t expectedCRC;
+    uint32_t completedChunks;
+    uint32_t updateResult;
+    bool interruptPending;
+    bool stopping;
+
+    Firmware firmware;
+
+    void pushChunk(const FringProtocol::CommandWrite *wrCmd, size_t wrSize);
+    void raiseInterrupt();
+};
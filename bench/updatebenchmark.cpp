@@ -0,0 +1,388 @@
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QDir>
+#include <QtEndian>
+#include <QDebug>
+
+#include <google/vcencoder.h>
+#include <linux/magic.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "updatebenchmark.h"
+#include "httpserver.h"
+#include "loopdevice.h"
+#include "updater.h"
+#include "imagepipeline.h"
+
+static const qint64 MiB = 1024 * 1024;
+
+// Images are modified in units of this size to derive an update from a seed
+static const qint64 changeBlockSize = 64 * 1024;
+
+// Android boot images are laid out in pages of this size
+static const quint32 bootPageSize = 2048;
+
+static inline quint64 nextRandom(quint64 *state)
+{
+    // xorshift64*, good enough for incompressible test data
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void fillRandom(char *data, qint64 length, quint64 *state)
+{
+    qint64 i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        quint64 r = nextRandom(state);
+        memcpy(data + i, &r, 8);
+    }
+
+    for (; i < length; i++)
+        data[i] = nextRandom(state);
+}
+
+static QByteArray gzip(const QByteArray &data)
+{
+    z_stream stream = {};
+
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return QByteArray();
+
+    QByteArray out(deflateBound(&stream, data.size()), Qt::Uninitialized);
+
+    stream.next_in = (Bytef *) data.constData();
+    stream.avail_in = data.size();
+    stream.next_out = (Bytef *) out.data();
+    stream.avail_out = out.size();
+
+    int ret = deflate(&stream, Z_FINISH);
+    out.resize(out.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    return ret == Z_STREAM_END ? out : QByteArray();
+}
+
+UpdateBenchmark::UpdateBenchmark(const Options &options, QObject *parent) :
+    QObject(parent),
+    options(options),
+    workDir(options.workDir + "/kalami-bench-XXXXXX"),
+    server(NULL)
+{
+}
+
+UpdateBenchmark::~UpdateBenchmark()
+{
+    qDeleteAll(loopDevices);
+
+    foreach (const QString &path, memoryFiles)
+        BlockDevice::releaseMemoryFile(path);
+
+    delete server;
+}
+
+QByteArray UpdateBenchmark::generateImage(ImageReader::ImageType type, qint64 size, quint64 seed)
+{
+    QByteArray data(size, Qt::Uninitialized);
+    uchar *p = (uchar *) data.data();
+
+    fillRandom(data.data(), size, &seed);
+
+    switch (type) {
+    case ImageReader::SquashFsType:
+        memset(p, 0, 96);
+        qToLittleEndian<quint32>(SQUASHFS_MAGIC, p);           // s_magic
+        qToLittleEndian<quint32>(128 * 1024, p + 12);          // block_size
+        qToLittleEndian<quint16>(17, p + 22);                  // block_log
+        qToLittleEndian<quint16>(4, p + 28);                   // s_major
+        qToLittleEndian<quint64>(size, p + 40);                // bytes_used
+        break;
+
+    case ImageReader::AndroidBootType: {
+        quint32 kernelSize = ((size - bootPageSize) * 3 / 4) & ~(qint64) (bootPageSize - 1);
+        quint32 initrdSize = size - bootPageSize - kernelSize;
+
+        memset(p, 0, bootPageSize);
+        memcpy(p, "ANDROID!", 8);
+        qToLittleEndian<quint32>(kernelSize, p + 8);           // kernel_size
+        qToLittleEndian<quint32>(initrdSize, p + 16);          // initrd_size
+        qToLittleEndian<quint32>(bootPageSize, p + 36);        // page_size
+        break;
+    }
+    }
+
+    return data;
+}
+
+void UpdateBenchmark::modifyImage(QByteArray *data, int changePercent, quint64 seed)
+{
+    // Leave the header block alone, so the image stays valid
+    for (qint64 offset = changeBlockSize; offset < data->size(); offset += changeBlockSize)
+        if ((int) (nextRandom(&seed) % 100) < changePercent)
+            fillRandom(data->data() + offset, qMin(changeBlockSize, data->size() - offset), &seed);
+}
+
+bool UpdateBenchmark::writeFile(const QString &path, const QByteArray &data)
+{
+    QFile file(path);
+
+    if (!file.open(QFile::WriteOnly) || file.write(data) != data.size()) {
+        qWarning() << "Unable to write" << path << ":" << file.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+qint64 UpdateBenchmark::procValue(const QString &path, const QByteArray &key)
+{
+    QFile file(path);
+
+    if (!file.open(QFile::ReadOnly))
+        return 0;
+
+    // Lines look like "Cached:   123456 kB"
+    foreach (const QByteArray &line, file.readAll().split('\n'))
+        if (line.startsWith(key + ":"))
+            return line.mid(key.size() + 1).trimmed().split(' ').value(0).toLongLong() * 1024;
+
+    return 0;
+}
+
+bool UpdateBenchmark::createDevice(const QString &name, qint64 size, const QByteArray &content, QString *path)
+{
+    QString backingFile = workDir.path() + "/" + name + ".raw";
+
+    if (options.backend == UpdateBenchmark::MemoryBackend) {
+        backingFile = BlockDevice::createMemoryFile(name, size);
+        if (backingFile.isEmpty())
+            return false;
+
+        memoryFiles.append(backingFile);
+    }
+
+    // ReadWrite doesn't truncate, which would throw away the memory file
+    QFile file(backingFile);
+
+    if (!file.open(QFile::ReadWrite) || file.write(content) != content.size() || !file.resize(size)) {
+        qWarning() << "Unable to create" << backingFile << ":" << file.errorString();
+        return false;
+    }
+
+    file.close();
+
+    if (options.backend != UpdateBenchmark::LoopBackend) {
+        *path = backingFile;
+        return true;
+    }
+
+    LoopDevice *loop = new LoopDevice();
+    loopDevices.append(loop);
+
+    if (!loop->attach(backingFile))
+        return false;
+
+    *path = loop->path();
+
+    return true;
+}
+
+bool UpdateBenchmark::prepareImage(Image *image)
+{
+    quint64 seed = image->type == ImageReader::SquashFsType ? 1 : 2;
+
+    QByteArray current = generateImage(image->type, image->size, seed);
+    QByteArray update = current;
+    modifyImage(&update, options.changePercent, seed + 100);
+
+    printf("Preparing %s image (%lld MiB, %d%% changed)\n",
+           image->name.toUtf8().constData(), image->size / MiB, options.changePercent);
+
+    image->sha512 = QCryptographicHash::hash(update, QCryptographicHash::Sha512).toHex();
+
+    QCryptographicHash root(QCryptographicHash::Sha512);
+    for (qint64 offset = 0; offset < update.size(); offset += MiB)
+        root.addData(QCryptographicHash::hash(update.mid(offset, MiB), QCryptographicHash::Sha512));
+
+    image->tree.blockSize = MiB;
+    image->tree.length = image->size;
+    image->tree.root = root.result().toHex();
+
+    // Give the partitions some slack, like the real ones have
+    if (!createDevice(image->name + "-seed", image->size + MiB, current, &image->seedDevice) ||
+        !createDevice(image->name + "-target", image->size + MiB, QByteArray(), &image->targetDevice))
+        return false;
+
+    std::string delta;
+    open_vcdiff::VCDiffEncoder encoder(current.constData(), current.size());
+
+    if (!encoder.Encode(update.constData(), update.size(), &delta)) {
+        qWarning() << "Unable to encode delta for" << image->name;
+        return false;
+    }
+
+    QString www = workDir.path() + "/www/";
+
+    return writeFile(www + image->name + ".img", update) &&
+           writeFile(www + image->name + ".img.gz", gzip(update)) &&
+           writeFile(www + image->name + ".vcdiff", QByteArray(delta.data(), delta.size()));
+}
+
+void UpdateBenchmark::dropCaches()
+{
+    ::sync();
+
+    QFile file("/proc/sys/vm/drop_caches");
+    if (file.open(QFile::WriteOnly))
+        file.write("3");
+}
+
+bool UpdateBenchmark::measure(const QString &phase, const Image &image, std::function<bool()> func)
+{
+    if (options.dropCaches)
+        dropCaches();
+
+    // Writing 5 to clear_refs resets the peak RSS to the current RSS
+    QFile clearRefs("/proc/self/clear_refs");
+    if (clearRefs.open(QFile::WriteOnly)) {
+        clearRefs.write("5");
+        clearRefs.close();
+    }
+
+    qint64 rss = procValue("/proc/self/status", "VmRSS");
+    qint64 cached = procValue("/proc/meminfo", "Cached");
+
+    QElapsedTimer timer;
+    timer.start();
+
+    Sample sample;
+    sample.ok = func();
+    sample.msecs = timer.elapsed();
+    sample.phase = phase;
+    sample.image = image.name;
+    sample.bytes = image.size;
+    sample.peakRss = procValue("/proc/self/status", "VmHWM") - rss;
+    sample.cacheGrowth = procValue("/proc/meminfo", "Cached") - cached;
+
+    samples.append(sample);
+
+    return sample.ok;
+}
+
+bool UpdateBenchmark::writeImage(const Image &image, const QByteArray &data)
+{
+    BlockDevice output(image.targetDevice);
+    if (!output.open(QFile::ReadWrite, BlockDevice::DirectIO | BlockDevice::AsyncIO))
+        return false;
+
+    ImagePipeline pipeline(&output);
+    if (!pipeline.start())
+        return false;
+
+    // Push in pieces of the size network reads typically deliver
+    for (qint64 offset = 0; offset < data.size(); offset += 64 * 1024) {
+        if (!pipeline.push(data.constData() + offset, qMin((qint64) 64 * 1024, data.size() - offset))) {
+            pipeline.abort();
+            return false;
+        }
+    }
+
+    return pipeline.finish() && pipeline.result().toHex() == image.sha512;
+}
+
+void UpdateBenchmark::printReport()
+{
+    printf("\n%-11s %-8s %10s %10s %10s %14s %14s %8s\n",
+           "phase", "image", "size MiB", "time s", "MiB/s", "peak RSS+ MiB", "page cache+ MiB", "result");
+
+    foreach (const Sample &s, samples) {
+        double seconds = s.msecs / 1000.0;
+
+        printf("%-11s %-8s %10.1f %10.2f %10.1f %14.1f %14.1f %8s\n",
+               s.phase.toUtf8().constData(), s.image.toUtf8().constData(),
+               (double) s.bytes / MiB, seconds,
+               seconds > 0 ? (double) s.bytes / MiB / seconds : 0.0,
+               (double) s.peakRss / MiB, (double) s.cacheGrowth / MiB,
+               s.ok ? "ok" : "FAILED");
+    }
+}
+
+bool UpdateBenchmark::run()
+{
+    if (!workDir.isValid() || !QDir(workDir.path()).mkdir("www")) {
+        qWarning() << "Unable to create working directory in" << options.workDir;
+        return false;
+    }
+
+    server = new HttpServer(workDir.path() + "/www");
+    if (!server->startServer())
+        return false;
+
+    QList<Image> images;
+    Image boot = { ImageReader::AndroidBootType, "boot", options.bootSize, QString(), TreeManifest(), QString(), QString() };
+    Image rootfs = { ImageReader::SquashFsType, "rootfs", options.rootfsSize, QString(), TreeManifest(), QString(), QString() };
+    images << boot << rootfs;
+
+    for (int i = 0; i < images.size(); i++)
+        if (!prepareImage(&images[i]))
+            return false;
+
+    UpdateThread thread(NULL, 0);
+    thread.setDirtyLimit(options.dirtyLimit);
+
+    bool ok = true;
+
+    foreach (const Image &image, images) {
+        QByteArray digest;
+        qint64 length;
+
+        printf("Benchmarking %s image\n", image.name.toUtf8().constData());
+
+        ok &= measure("download", image, [&]() {
+            return thread.downloadFullImage(server->url(image.name + ".img"), image.targetDevice,
+                                            image.sha512, &digest, &length) &&
+                   digest.toHex() == image.sha512;
+        });
+
+        CompressedManifest compressed;
+        compressed.url = server->url(image.name + ".img.gz");
+        compressed.codec = "gzip";
+        compressed.length = image.size;
+
+        ok &= measure("download-gz", image, [&]() {
+            return thread.fetchFullImage(compressed.url, image.targetDevice, NULL, &digest, &length, &compressed) &&
+                   digest.toHex() == image.sha512;
+        });
+
+        ok &= measure("verify", image, [&]() {
+            return thread.verifyImage(image.type, image.targetDevice, image.sha512, TreeManifest());
+        });
+
+        ok &= measure("verify-tree", image, [&]() {
+            return thread.verifyImage(image.type, image.targetDevice, image.sha512, image.tree);
+        });
+
+        ok &= measure("decode", image, [&]() {
+            return thread.downloadDeltaImage(image.type, server->url(image.name + ".vcdiff"),
+                                             image.seedDevice, image.targetDevice, &digest, &length) &&
+                   digest.toHex() == image.sha512;
+        });
+
+        QFile file(workDir.path() + "/www/" + image.name + ".img");
+        QByteArray data = file.open(QFile::ReadOnly) ? file.readAll() : QByteArray();
+
+        ok &= measure("write", image, [&]() {
+            return writeImage(image, data);
+        });
+    }
+
+    printReport();
+
+    return ok;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QObject>
+#include <QList>
+#include <QStringList>
+#include <QTemporaryDir>
+
+#include <functional>
+
+#include "imagereader.h"
+#include "treeverifier.h"
+
+class HttpServer;
+class LoopDevice;
+
+//
+// UpdateBenchmark measures the phases of an image update against stand-in
+// partitions. For every image type, it generates a seed image and an update
+// derived from it, serves the full update and a VCDIFF delta from a local
+// HTTP server, and runs the UpdateThread code paths against loop devices,
+// sparse files or memory files.
+// Timings, throughput, peak RSS and page cache growth are reported for every
+// phase.
+//
+
+class UpdateBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Backend {
+        LoopBackend,
+        FileBackend,
+        MemoryBackend,
+    };
+
+    struct Options {
+        Backend backend;
+        QString workDir;
+        qint64 bootSize;
+        qint64 rootfsSize;
+        int changePercent;
+        qint64 dirtyLimit;
+        bool dropCaches;
+    };
+
+    explicit UpdateBenchmark(const Options &options, QObject *parent = 0);
+    ~UpdateBenchmark();
+
+    bool run();
+
+private:
+    struct Image {
+        ImageReader::ImageType type;
+        QString name;
+        qint64 size;
+        QString sha512;
+        TreeManifest tree;
+        QString seedDevice;
+        QString targetDevice;
+    };
+
+    struct Sample {
+        QString phase;
+        QString image;
+        qint64 bytes;
+        qint64 msecs;
+        qint64 peakRss;
+        qint64 cacheGrowth;
+        bool ok;
+    };
+
+    Options options;
+    QTemporaryDir workDir;
+    HttpServer *server;
+    QList<LoopDevice *> loopDevices;
+    QStringList memoryFiles;
+    QList<Sample> samples;
+
+    bool prepareImage(Image *image);
+    bool createDevice(const QString &name, qint64 size, const QByteArray &content, QString *path);
+    bool writeImage(const Image &image, const QByteArray &data);
+    bool measure(const QString &phase, const Image &image, std::function<bool()> func);
+    void dropCaches();
+    void printReport();
+
+    static QByteArray generateImage(ImageReader::ImageType type, qint64 size, quint64 seed);
+    static void modifyImage(QByteArray *data, int changePercent, quint64 seed);
+    static bool writeFile(const QString &path, const QByteArray &data);
+    static qint64 procValue(const QString &path, const QByteArray &key);
+};
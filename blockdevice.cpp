@@ -5,17 +5,32 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
 
 #include "blockdevice.h"
+#include "iouring.h"
 
 Q_LOGGING_CATEGORY(BlockDeviceLog, "BlockDevice")
 
 BlockDevice::BlockDevice(const QString path, QObject *parent) :
     QObject(parent),
+    path(path),
     file(path),
     deviceMaxSize(0),
-    mappedBuffer(NULL)
+    mappedBuffer(NULL),
+    directIO(false),
+    currentStage(0),
+    stageError(false),
+    stage(NULL),
+    stageOffset(0),
+    stageFill(0),
+    ring(NULL),
+    inFlight(0),
+    pendingRequests(0)
 {
 }
 
@@ -24,13 +39,109 @@ BlockDevice::~BlockDevice()
     close();
 }
 
-bool BlockDevice::open(QFile::OpenMode m)
+char *BlockDevice::allocateBuffer(qint64 size)
+{
+    void *buf;
+
+    if (posix_memalign(&buf, BlockDevice::directAlignment, size) != 0)
+        return NULL;
+
+    return (char *) buf;
+}
+
+void BlockDevice::freeBuffer(char *buf)
+{
+    free(buf);
+}
+
+QString BlockDevice::createMemoryFile(const QString &name, qint64 size)
+{
+    int fd = memfd_create(name.toLocal8Bit().constData(), MFD_CLOEXEC);
+    if (fd < 0) {
+        qWarning(BlockDeviceLog) << "Unable to create memory file" << name << ":" << strerror(errno);
+        return QString();
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        qWarning(BlockDeviceLog) << "Unable to resize memory file" << name << ":" << strerror(errno);
+        ::close(fd);
+        return QString();
+    }
+
+    return QString("/proc/self/fd/%1").arg(fd);
+}
+
+void BlockDevice::releaseMemoryFile(const QString &path)
+{
+    bool ok;
+    int fd = path.section('/', -1).toInt(&ok);
+
+    if (ok && path.startsWith("/proc/self/fd/"))
+        ::close(fd);
+}
+
+bool BlockDevice::open(QFile::OpenMode m, int flags)
 {
     int ret;
     struct stat stat;
 
-    if (!file.open(m)) {
-        qWarning(BlockDeviceLog) << "Error opening" << file.fileName()
+    directIO = !!(flags & BlockDevice::DirectIO);
+
+    if (flags & BlockDevice::AsyncIO) {
+        ring = new IoUring();
+
+        if (!ring->isValid()) {
+            qInfo(BlockDeviceLog) << "io_uring is not available, using synchronous I/O for" << path;
+            delete ring;
+            ring = NULL;
+        }
+    }
+
+    if (directIO) {
+        // QFile can't be asked for O_DIRECT, so open the device ourselves
+        int oflags = O_CLOEXEC | O_DIRECT;
+
+        if ((m & QFile::ReadWrite) == QFile::ReadWrite)
+            oflags |= O_RDWR;
+        else if (m & QFile::WriteOnly)
+            oflags |= O_WRONLY;
+        else
+            oflags |= O_RDONLY;
+
+        int fd = ::open(path.toLocal8Bit().constData(), oflags);
+
+        // Some file systems, tmpfs among them, don't support O_DIRECT. Writes
+        // are still staged in aligned blocks then, but go through the cache.
+        if (fd < 0 && errno == EINVAL) {
+            qInfo(BlockDeviceLog) << path << "does not support direct I/O, using buffered I/O";
+            fd = ::open(path.toLocal8Bit().constData(), oflags & ~O_DIRECT);
+        }
+
+        if (fd < 0 || !file.open(fd, m | QFile::Unbuffered, QFileDevice::AutoCloseHandle)) {
+            qWarning(BlockDeviceLog) << "Error opening" << path << "for direct I/O:" << strerror(errno);
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+
+        int numStages = ring ? BlockDevice::asyncStages : 1;
+
+        for (int i = 0; i < numStages; i++) {
+            char *buf = BlockDevice::allocateBuffer(BlockDevice::stageSize);
+            if (!buf)
+                return false;
+
+            stages.append(buf);
+            stagePending.append(0);
+        }
+
+        currentStage = 0;
+        stageError = false;
+        stage = stages[0];
+        stageOffset = 0;
+        stageFill = 0;
+    } else if (!file.open(m)) {
+        qWarning(BlockDeviceLog) << "Error opening" << path
                                  << ":" << file.errorString();
         return false;
     }
@@ -39,14 +150,21 @@ bool BlockDevice::open(QFile::OpenMode m)
     if (ret < 0)
         return false;
 
+    // Regular files, including memory files, stand in for a partition of
+    // their current size.
+    if (S_ISREG(stat.st_mode)) {
+        deviceMaxSize = stat.st_size;
+        return true;
+    }
+
     if (!S_ISBLK(stat.st_mode)) {
-        qWarning(BlockDeviceLog) << file.fileName() << "is not a block device";
+        qWarning(BlockDeviceLog) << path << "is neither a block device nor a regular file";
         return false;
     }
 
     ret = ioctl(file.handle(), BLKGETSIZE64, &deviceMaxSize);
     if (ret < 0) {
-        qWarning() << "Cannot determine size of device" << file.fileName();
+        qWarning() << "Cannot determine size of device" << path;
         return false;
     }
 
@@ -60,10 +178,88 @@ void BlockDevice::close()
         mappedBuffer = NULL;
     }
 
+    if (!stages.isEmpty() && file.isOpen())
+        sync();
+
+    // The kernel may still access buffers of outstanding requests, including
+    // the stages, so they are only freed once everything completed.
+    if (ring) {
+        while (inFlight > 0 && reapCompletion());
+
+        delete ring;
+        ring = NULL;
+    }
+
+    if (!stages.isEmpty()) {
+        for (int i = 0; i < stages.size(); i++)
+            BlockDevice::freeBuffer(stages[i]);
+
+        stages.clear();
+        stagePending.clear();
+        stage = NULL;
+    }
+
+    completions.clear();
+    inFlight = 0;
+    pendingRequests = 0;
+
     file.close();
 }
 
-char *BlockDevice::map()
+bool BlockDevice::dropCache()
+{
+    if (!file.isOpen())
+        return false;
+
+    return posix_fadvise(file.handle(), 0, 0, POSIX_FADV_DONTNEED) == 0;
+}
+
+bool BlockDevice::advise(AccessPattern pattern)
+{
+    if (!file.isOpen())
+        return false;
+
+    int advice = POSIX_FADV_NORMAL;
+
+    if (pattern == BlockDevice::SequentialAccess)
+        advice = POSIX_FADV_SEQUENTIAL;
+    else if (pattern == BlockDevice::RandomAccess)
+        advice = POSIX_FADV_RANDOM;
+
+    if (posix_fadvise(file.handle(), 0, 0, advice) != 0)
+        return false;
+
+    if (mappedBuffer) {
+        advice = MADV_NORMAL;
+
+        if (pattern == BlockDevice::SequentialAccess)
+            advice = MADV_SEQUENTIAL;
+        else if (pattern == BlockDevice::RandomAccess)
+            advice = MADV_RANDOM;
+
+        if (madvise(mappedBuffer, deviceMaxSize, advice) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+bool BlockDevice::prefetch(qint64 offset, qint64 length)
+{
+    if (!file.isOpen() || offset >= deviceMaxSize)
+        return false;
+
+    // Start reading the range into the page cache without waiting for it
+    qint64 start = offset & ~(qint64) (getpagesize() - 1);
+    qint64 end = qMin(offset + length, deviceMaxSize);
+
+    if (mappedBuffer)
+        return madvise(mappedBuffer + start, end - start, MADV_WILLNEED) == 0;
+
+    return posix_fadvise(file.handle(), start, end - start, POSIX_FADV_WILLNEED) == 0;
+}
+
+char *BlockDevice::map(AccessPattern pattern)
 {
     if (!file.isOpen())
         return NULL;
@@ -77,11 +273,16 @@ char *BlockDevice::map()
         if (file.openMode() & QFile::WriteOnly)
             prot |= PROT_WRITE;
 
-        mappedBuffer = (char *) mmap(NULL, deviceMaxSize, prot, MAP_SHARED, file.handle(), 0);
+        void *addr = mmap(NULL, deviceMaxSize, prot, MAP_SHARED, file.handle(), 0);
+        if (addr == MAP_FAILED) {
+            qWarning(BlockDeviceLog) << "Unable to map" << path << ":" << strerror(errno);
+            return NULL;
+        }
+
+        mappedBuffer = (char *) addr;
     }
 
-    if (!mappedBuffer)
-        qWarning(BlockDeviceLog) << "Unable to map" << file.fileName();
+    advise(pattern);
 
     return mappedBuffer;
 }
@@ -93,7 +294,340 @@ qint64 BlockDevice::read(char *data, qint64 length)
 
 qint64 BlockDevice::write(const char *data, qint64 length)
 {
-    return file.write(data, length);
+    if (!directIO)
+        return file.write(data, length);
+
+    qint64 done = 0;
+
+    while (done < length) {
+        // Aligned writes bypass the staging buffer entirely, unless the stage
+        // is written asynchronously, as we can't hold on to the caller's buffer.
+        if (!ring && stageFill == 0 &&
+            ((quintptr) (data + done) % BlockDevice::directAlignment) == 0 &&
+            length - done >= BlockDevice::directAlignment) {
+            qint64 l = (length - done) & ~(BlockDevice::directAlignment - 1);
+
+            if (writeAt(data + done, l, stageOffset) != l)
+                return done > 0 ? done : -1;
+
+            stageOffset += l;
+            done += l;
+            continue;
+        }
+
+        qint64 l = qMin(BlockDevice::stageSize - stageFill, length - done);
+
+        memcpy(stage + stageFill, data + done, l);
+        stageFill += l;
+        done += l;
+
+        if (stageFill == BlockDevice::stageSize && !flushStage(false))
+            return -1;
+    }
+
+    return done;
 }
 
+bool BlockDevice::flushStage(bool includeTail)
+{
+    qint64 aligned = stageFill & ~(BlockDevice::directAlignment - 1);
+    qint64 tail = stageFill - aligned;
+    qint64 l = aligned;
+
+    if (ring && !includeTail) {
+        if (aligned == 0)
+            return !stageError;
+
+        // Hand the full part of the stage to the kernel and continue filling
+        // the next free buffer of the pool, starting with the tail.
+        int next = -1;
+
+        while (next < 0) {
+            for (int i = 0; i < stages.size() && next < 0; i++)
+                if (i != currentStage && stagePending[i] == 0)
+                    next = i;
+
+            if (next < 0 && !reapCompletion())
+                return false;
+        }
+
+        if (!queueRequest(true, stage, aligned, stageOffset, BlockDevice::stageTag | currentStage) ||
+            !submit())
+            return false;
+
+        stagePending[currentStage] = aligned;
+        memcpy(stages[next], stage + aligned, tail);
+
+        currentStage = next;
+        stage = stages[next];
+        stageOffset += aligned;
+        stageFill = tail;
+
+        return !stageError;
+    }
+
+    if (ring && !drainStages())
+        return false;
+
+    // The tail is padded to the alignment and written, but kept in the staging
+    // buffer so subsequent writes complete that block later.
+    if (includeTail && tail > 0) {
+        l += BlockDevice::directAlignment;
+        memset(stage + stageFill, 0, l - stageFill);
+    }
+
+    if (l > 0 && writeAt(stage, l, stageOffset) != l)
+        return false;
+
+    if (aligned > 0) {
+        memmove(stage, stage + aligned, tail);
+        stageOffset += aligned;
+        stageFill = tail;
+    }
+
+    return true;
+}
+
+qint64 BlockDevice::readAt(char *data, qint64 length, qint64 offset)
+{
+    qint64 done = 0;
+
+    while (done < length) {
+        ssize_t r = pread(file.handle(), data + done, length - done, offset + done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+
+            qWarning(BlockDeviceLog) << "Unable to read from" << path
+                                     << "at offset" << offset + done << ":" << strerror(errno);
+            return -1;
+        }
+
+        if (r == 0)
+            break;
+
+        done += r;
+    }
+
+    return done;
+}
 
+qint64 BlockDevice::writeAt(const char *data, qint64 length, qint64 offset)
+{
+    qint64 done = 0;
+
+    while (done < length) {
+        ssize_t r = pwrite(file.handle(), data + done, length - done, offset + done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+
+            qWarning(BlockDeviceLog) << "Unable to write to" << path
+                                     << "at offset" << offset + done << ":" << strerror(errno);
+            return -1;
+        }
+
+        done += r;
+    }
+
+    return done;
+}
+
+bool BlockDevice::seek(qint64 pos)
+{
+    if (!directIO)
+        return file.seek(pos);
+
+    if (!flushStage(true))
+        return false;
+
+    // Preload the partial block at the new position, as it will be rewritten
+    // as a whole.
+    stageOffset = pos & ~(BlockDevice::directAlignment - 1);
+    stageFill = pos - stageOffset;
+
+    if (stageFill > 0 && readAt(stage, BlockDevice::directAlignment, stageOffset) != BlockDevice::directAlignment)
+        return false;
+
+    return true;
+}
+
+bool BlockDevice::sync()
+{
+    if (directIO && !flushStage(true))
+        return false;
+
+    if (!file.flush())
+        return false;
+
+    if (fdatasync(file.handle()) < 0) {
+        qWarning(BlockDeviceLog) << "Unable to sync" << path << ":" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool BlockDevice::writeback(qint64 offset, qint64 length, bool wait)
+{
+    if (!file.isOpen() || !file.flush())
+        return false;
+
+    // Without waiting, writeback of the range is only started. Once it has
+    // completed, the pages are clean and can be dropped from the page cache.
+    unsigned int flags = SYNC_FILE_RANGE_WRITE;
+
+    if (wait)
+        flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+
+    if (sync_file_range(file.handle(), offset, length, flags) < 0) {
+        qWarning(BlockDeviceLog) << "Unable to write back" << path << ":" << strerror(errno);
+        return false;
+    }
+
+    if (wait)
+        posix_fadvise(file.handle(), offset, length, POSIX_FADV_DONTNEED);
+
+    return true;
+}
+
+bool BlockDevice::queueRequest(bool write, char *data, qint64 length, qint64 offset, quint64 tag)
+{
+    // Never have more requests in flight than the completion ring can take
+    while (inFlight >= (int) ring->capacity())
+        if (!reapCompletion())
+            return false;
+
+    bool ok = write ?
+        ring->prepareWrite(file.handle(), data, length, offset, tag) :
+        ring->prepareRead(file.handle(), data, length, offset, tag);
+
+    if (!ok) {
+        qWarning(BlockDeviceLog) << "Unable to queue request for" << path << "at offset" << offset;
+        return false;
+    }
+
+    inFlight++;
+
+    return true;
+}
+
+bool BlockDevice::reapCompletion()
+{
+    uint64_t tag;
+    int res;
+
+    if (!ring->reap(&tag, &res, true)) {
+        qWarning(BlockDeviceLog) << "Unable to wait for I/O completion on" << path << ":" << strerror(errno);
+        return false;
+    }
+
+    inFlight--;
+
+    if (tag & BlockDevice::stageTag) {
+        int index = tag & ~BlockDevice::stageTag;
+
+        if (res != stagePending[index]) {
+            qWarning(BlockDeviceLog) << "Unable to write to" << path << ":"
+                                     << (res < 0 ? strerror(-res) : "short write");
+            stageError = true;
+        }
+
+        stagePending[index] = 0;
+    } else {
+        if (res < 0)
+            qWarning(BlockDeviceLog) << "I/O request on" << path << "failed:" << strerror(-res);
+
+        Completion c = { tag, res < 0 ? -1 : res };
+        completions.enqueue(c);
+    }
+
+    return true;
+}
+
+bool BlockDevice::drainStages()
+{
+    forever {
+        bool busy = false;
+
+        for (int i = 0; i < stagePending.size(); i++)
+            busy |= stagePending[i] > 0;
+
+        if (!busy)
+            break;
+
+        if (!reapCompletion())
+            return false;
+    }
+
+    return !stageError;
+}
+
+bool BlockDevice::queueRead(char *data, qint64 length, qint64 offset, quint64 tag)
+{
+    Q_ASSERT(!(tag & BlockDevice::stageTag));
+
+    pendingRequests++;
+
+    if (!ring) {
+        Completion c = { tag, readAt(data, length, offset) };
+        completions.enqueue(c);
+        return true;
+    }
+
+    if (!queueRequest(false, data, length, offset, tag)) {
+        pendingRequests--;
+        return false;
+    }
+
+    return true;
+}
+
+bool BlockDevice::queueWrite(const char *data, qint64 length, qint64 offset, quint64 tag)
+{
+    Q_ASSERT(!(tag & BlockDevice::stageTag));
+
+    pendingRequests++;
+
+    if (!ring) {
+        Completion c = { tag, writeAt(data, length, offset) };
+        completions.enqueue(c);
+        return true;
+    }
+
+    if (!queueRequest(true, (char *) data, length, offset, tag)) {
+        pendingRequests--;
+        return false;
+    }
+
+    return true;
+}
+
+bool BlockDevice::submit()
+{
+    if (ring && !ring->submit()) {
+        qWarning(BlockDeviceLog) << "Unable to submit I/O requests for" << path << ":" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool BlockDevice::waitCompletion(quint64 *tag, qint64 *result)
+{
+    while (completions.isEmpty()) {
+        if (!ring || pendingRequests == 0)
+            return false;
+
+        if (!reapCompletion())
+            return false;
+    }
+
+    Completion c = completions.dequeue();
+    pendingRequests--;
+
+    *tag = c.tag;
+    *result = c.result;
+
+    return true;
+}
@@ -3,10 +3,14 @@
 
 #include <QObject>
 #include <QFile>
+#include <QQueue>
+#include <QVector>
 #include <QtCore/QLoggingCategory>
 
 Q_DECLARE_LOGGING_CATEGORY(BlockDeviceLog)
 
+class IoUring;
+
 class BlockDevice : public QObject
 {
     Q_OBJECT
@@ -14,18 +18,91 @@ public:
     explicit BlockDevice(const QString path, QObject *parent = 0);
     ~BlockDevice();
 
-    QString fileName() const { return file.fileName(); }
+    enum OpenFlag {
+        NoFlags     = 0x00,
+        DirectIO    = 0x01,
+        AsyncIO     = 0x02,
+    };
+
+    enum AccessPattern {
+        NormalAccess,
+        SequentialAccess,
+        RandomAccess,
+    };
+
+    QString fileName() const { return path; }
     qint64 maxSize() { return deviceMaxSize; }
-    bool open(QFile::OpenMode m = QIODevice::ReadOnly);
+    bool open(QFile::OpenMode m = QIODevice::ReadOnly, int flags = BlockDevice::NoFlags);
     void close();
-    char *map();
+    bool dropCache();
+    bool advise(AccessPattern pattern);
+    bool prefetch(qint64 offset, qint64 length);
+    char *map(AccessPattern pattern = NormalAccess);
     qint64 read(char *data, qint64 length);
+    qint64 readAt(char *data, qint64 length, qint64 offset);
     qint64 write(const char *data, qint64 length);
+    qint64 writeAt(const char *data, qint64 length, qint64 offset);
+    bool seek(qint64 pos);
+    bool sync();
+    bool writeback(qint64 offset, qint64 length, bool wait);
+
+    // Asynchronous I/O. Requests are collected and handed to the kernel in one
+    // batch by submit(), and waitCompletion() returns them in the order they
+    // complete. Devices opened without AsyncIO, or on kernels without io_uring,
+    // execute requests synchronously when they are queued.
+    bool asyncIO() const { return ring != NULL; }
+    bool queueRead(char *data, qint64 length, qint64 offset, quint64 tag);
+    bool queueWrite(const char *data, qint64 length, qint64 offset, quint64 tag);
+    bool submit();
+    bool waitCompletion(quint64 *tag, qint64 *result);
+
+    static char *allocateBuffer(qint64 size);
+    static void freeBuffer(char *buf);
+
+    // Anonymous in-memory files can stand in for partitions when testing, or
+    // hold intermediate images. The returned path can be opened like a device
+    // until the file is released.
+    static QString createMemoryFile(const QString &name, qint64 size);
+    static void releaseMemoryFile(const QString &path);
 
 private:
+    static const qint64 directAlignment = 4096;
+    static const qint64 stageSize = 1024 * 1024;
+    static const int asyncStages = 4;
+    static const quint64 stageTag = 1ULL << 63;
+
+    struct Completion {
+        quint64 tag;
+        qint64 result;
+    };
+
+    QString path;
     QFile file;
     qint64 deviceMaxSize;
     char *mappedBuffer;
+
+    // Sequential writes in O_DIRECT mode are collected in an aligned staging
+    // buffer that always starts at an aligned device offset. With io_uring,
+    // full staging buffers are written asynchronously while the next one of
+    // the pool is being filled.
+    bool directIO;
+    QVector<char *> stages;
+    QVector<qint64> stagePending;
+    int currentStage;
+    bool stageError;
+    char *stage;
+    qint64 stageOffset;
+    qint64 stageFill;
+
+    IoUring *ring;
+    int inFlight;
+    int pendingRequests;
+    QQueue<Completion> completions;
+
+    bool flushStage(bool includeTail);
+    bool queueRequest(bool write, char *data, qint64 length, qint64 offset, quint64 tag);
+    bool reapCompletion();
+    bool drainStages();
 };
 
 #endif // BLOCKDEVICE_H
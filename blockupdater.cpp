@@ -0,0 +1,271 @@
+#include <QHash>
+#include <QTimer>
+#include <QEventLoop>
+#include <QCryptographicHash>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+
+#include "blockupdater.h"
+#include "chunkeddownloader.h"
+#include "sha512.h"
+
+Q_LOGGING_CATEGORY(BlockUpdaterLog, "BlockUpdater")
+
+const qint64 BlockUpdater::scanBufferSize;
+
+bool BlockManifest::isValid() const
+{
+    // The seed and target are scanned in buffers holding whole blocks
+    if (blockSize < BlockManifest::minBlockSize || blockSize > BlockUpdater::scanBufferSize ||
+        BlockUpdater::scanBufferSize % blockSize != 0)
+        return false;
+
+    return url.isValid() && !sha512.isEmpty() && length > 0;
+}
+
+BlockManifest BlockManifest::fromJson(const QJsonObject &json)
+{
+    BlockManifest manifest;
+
+    manifest.url = QUrl(json["url"].toString());
+    manifest.sha512 = json["sha512"].toString();
+    manifest.blockSize = (qint64) json["block_size"].toDouble();
+    manifest.length = (qint64) json["length"].toDouble();
+
+    return manifest;
+}
+
+BlockUpdater::BlockUpdater(const QUrl &imageUrl, const BlockManifest &manifest,
+                           BlockDevice *seed, qint64 seedSize, BlockDevice *target,
+                           int connections, QObject *parent) :
+    QObject(parent),
+    imageUrl(imageUrl),
+    manifest(manifest),
+    seed(seed),
+    seedSize(seedSize),
+    target(target),
+    connections(connections),
+    blockMap(),
+    numBlocks(0)
+{
+}
+
+QByteArray BlockUpdater::blockHash(const char *data, qint64 length) const
+{
+    Sha512 hash;
+
+    hash.addData(data, length);
+
+    return hash.result().left(hashLength);
+}
+
+QVector<QByteArray> BlockUpdater::blockHashes(const char *data, qint64 length) const
+{
+    // Full blocks are independent messages of the same length, which can be
+    // hashed several at a time.
+    int full = length / manifest.blockSize;
+    QVector<const char *> blocks(full);
+    QVector<QByteArray> hashes(full);
+
+    for (int i = 0; i < full; i++)
+        blocks[i] = data + i * manifest.blockSize;
+
+    Sha512::hashMany(blocks.constData(), full, manifest.blockSize, hashes.data());
+
+    for (int i = 0; i < full; i++)
+        hashes[i].truncate(hashLength);
+
+    if (length % manifest.blockSize)
+        hashes.append(blockHash(data + full * manifest.blockSize, length % manifest.blockSize));
+
+    return hashes;
+}
+
+QByteArray BlockUpdater::expectedHash(int block) const
+{
+    return blockMap.mid(block * hashLength, hashLength);
+}
+
+qint64 BlockUpdater::blockLength(int block) const
+{
+    return qMin(manifest.blockSize, manifest.length - block * manifest.blockSize);
+}
+
+bool BlockUpdater::fetchBlockMap()
+{
+    QEventLoop loop;
+    QTimer timer;
+
+    QNetworkAccessManager networkAccessManager;
+    networkAccessManager.setNetworkAccessible(QNetworkAccessManager::Accessible);
+
+    QNetworkReply *reply = networkAccessManager.get(QNetworkRequest(manifest.url));
+    QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+
+    QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+    timer.setSingleShot(true);
+    timer.start(60 * 1000);
+
+    loop.exec();
+
+    if (!reply->isFinished() || reply->error() != QNetworkReply::NoError) {
+        qInfo(BlockUpdaterLog) << "Unable to download block map" << manifest.url << ":" << reply->errorString();
+        reply->abort();
+        reply->deleteLater();
+        return false;
+    }
+
+    blockMap = reply->readAll();
+    reply->deleteLater();
+
+    QByteArray sha512 = QCryptographicHash::hash(blockMap, QCryptographicHash::Sha512).toHex();
+    if (sha512 != manifest.sha512) {
+        qInfo(BlockUpdaterLog) << "Checksum mismatch for block map" << manifest.url;
+        return false;
+    }
+
+    numBlocks = (manifest.length + manifest.blockSize - 1) / manifest.blockSize;
+
+    if (blockMap.size() != numBlocks * hashLength) {
+        qInfo(BlockUpdaterLog) << "Block map size" << blockMap.size() << "does not match"
+                               << numBlocks << "blocks";
+        return false;
+    }
+
+    return true;
+}
+
+bool BlockUpdater::scanTarget(QVector<bool> *done)
+{
+    QByteArray buf(scanBufferSize, 0);
+    int unchanged = 0;
+
+    for (qint64 offset = 0; offset < manifest.length; offset += scanBufferSize) {
+        qint64 l = qMin(scanBufferSize, manifest.length - offset);
+
+        if (target->readAt(buf.data(), l, offset) != l)
+            return false;
+
+        QVector<QByteArray> hashes = blockHashes(buf.constData(), l);
+
+        for (int i = 0; i < hashes.size(); i++) {
+            int block = offset / manifest.blockSize + i;
+
+            if (hashes[i] == expectedHash(block)) {
+                (*done)[block] = true;
+                unchanged++;
+            }
+        }
+    }
+
+    qInfo(BlockUpdaterLog) << unchanged << "of" << numBlocks << "blocks are unchanged in" << target->fileName();
+
+    return true;
+}
+
+bool BlockUpdater::copyFromSeed(QVector<bool> *done, qint64 *copied)
+{
+    // Index the blocks we still need by content
+    QHash<QByteArray, QList<int> > needed;
+
+    for (int block = 0; block < numBlocks; block++)
+        if (!(*done)[block] && blockLength(block) == manifest.blockSize)
+            needed[expectedHash(block)].append(block);
+
+    if (needed.isEmpty())
+        return true;
+
+    QByteArray buf(scanBufferSize, 0);
+    qint64 end = seedSize - seedSize % manifest.blockSize;
+
+    for (qint64 offset = 0; offset < end && !needed.isEmpty(); offset += scanBufferSize) {
+        qint64 l = qMin(scanBufferSize, end - offset);
+
+        if (seed->readAt(buf.data(), l, offset) != l)
+            return false;
+
+        QVector<QByteArray> hashes = blockHashes(buf.constData(), l);
+
+        for (int i = 0; i < hashes.size(); i++) {
+            qint64 pos = i * manifest.blockSize;
+
+            QHash<QByteArray, QList<int> >::iterator it = needed.find(hashes[i]);
+            if (it == needed.end())
+                continue;
+
+            foreach (int block, it.value()) {
+                qint64 r = target->writeAt(buf.constData() + pos, manifest.blockSize, block * manifest.blockSize);
+                if (r != manifest.blockSize)
+                    return false;
+
+                (*done)[block] = true;
+                *copied += manifest.blockSize;
+            }
+
+            needed.erase(it);
+        }
+    }
+
+    return true;
+}
+
+bool BlockUpdater::fetchMissing(const QVector<bool> &done, qint64 *fetched)
+{
+    QList<QPair<qint64, qint64> > ranges;
+    int block = 0;
+
+    // Coalesce missing blocks into ranges, bridging small gaps of present blocks
+    // to save on requests.
+    while (block < numBlocks) {
+        if (done[block]) {
+            block++;
+            continue;
+        }
+
+        int first = block, last = block;
+
+        for (block++; block < numBlocks && block - last <= maxRangeGap; block++)
+            if (!done[block])
+                last = block;
+
+        qint64 offset = first * manifest.blockSize;
+        qint64 length = last * manifest.blockSize + blockLength(last) - offset;
+
+        ranges.append(qMakePair(offset, length));
+        *fetched += length;
+        block = last + 1;
+    }
+
+    if (ranges.isEmpty())
+        return true;
+
+    ChunkedDownloader downloader(imageUrl, target, ranges, connections);
+    QObject::connect(&downloader, &ChunkedDownloader::progress, this, &BlockUpdater::progress);
+
+    return downloader.download();
+}
+
+bool BlockUpdater::update()
+{
+    if (!manifest.isValid() || manifest.length > target->maxSize())
+        return false;
+
+    if (!fetchBlockMap())
+        return false;
+
+    QVector<bool> done(numBlocks, false);
+    qint64 copied = 0, fetched = 0;
+
+    if (!scanTarget(&done) || !copyFromSeed(&done, &copied))
+        return false;
+
+    if (!fetchMissing(done, &fetched))
+        return false;
+
+    qInfo(BlockUpdaterLog) << "Block update of" << target->fileName() << "done:"
+                           << copied << "bytes copied from seed,"
+                           << fetched << "bytes fetched from" << imageUrl;
+
+    return target->sync();
+}
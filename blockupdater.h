@@ -0,0 +1,83 @@
+#pragma once
+
+#include <QObject>
+#include <QUrl>
+#include <QVector>
+#include <QJsonObject>
+#include <QtCore/QLoggingCategory>
+
+#include "blockdevice.h"
+
+Q_DECLARE_LOGGING_CATEGORY(BlockUpdaterLog)
+
+//
+// Block map of an image as published in the update Json:
+//
+//   "rootfs_blockmap": { "url": <url>, "sha512": <sha512 of the map>, "block_size": 4096, "length": <image length> }
+//
+// The map file itself is a plain concatenation of the first 32 bytes of the
+// SHA512 sum of every block of the image, in order. The last block is hashed
+// over its actual length. The block size must be at least 512 bytes and
+// divide 1 MiB evenly.
+//
+
+struct BlockManifest {
+    static const qint64 minBlockSize = 512;
+
+    QUrl url;
+    QString sha512;
+    qint64 blockSize;
+    qint64 length;
+
+    BlockManifest() : blockSize(0), length(0) {}
+    bool isValid() const;
+    static BlockManifest fromJson(const QJsonObject &json);
+};
+
+//
+// BlockUpdater brings a target device up to date with an image described by a
+// block map. Blocks that already match in the target are left alone, blocks
+// that can be found anywhere in the seed image are copied locally, and only the
+// remaining ones are fetched from the full image with range requests.
+//
+
+class BlockUpdater : public QObject
+{
+    Q_OBJECT
+
+public:
+    BlockUpdater(const QUrl &imageUrl, const BlockManifest &manifest,
+                 BlockDevice *seed, qint64 seedSize, BlockDevice *target,
+                 int connections = 4, QObject *parent = 0);
+
+    bool update();
+
+signals:
+    void progress(qint64 bytesReceived, qint64 bytesTotal);
+
+private:
+    friend struct BlockManifest;
+
+    static const int hashLength = 32;
+    static const qint64 scanBufferSize = 1024 * 1024;
+    static const int maxRangeGap = 4;
+
+    QUrl imageUrl;
+    BlockManifest manifest;
+    BlockDevice *seed;
+    qint64 seedSize;
+    BlockDevice *target;
+    int connections;
+
+    QByteArray blockMap;
+    int numBlocks;
+
+    bool fetchBlockMap();
+    QByteArray blockHash(const char *data, qint64 length) const;
+    QVector<QByteArray> blockHashes(const char *data, qint64 length) const;
+    QByteArray expectedHash(int block) const;
+    qint64 blockLength(int block) const;
+    bool scanTarget(QVector<bool> *done);
+    bool copyFromSeed(QVector<bool> *done, qint64 *copied);
+    bool fetchMissing(const QVector<bool> &done, qint64 *fetched);
+};
@@ -0,0 +1,249 @@
+#include <QJsonArray>
+#include <QNetworkRequest>
+
+#include "chunkeddownloader.h"
+
+Q_LOGGING_CATEGORY(ChunkedDownloaderLog, "ChunkedDownloader")
+
+bool ChunkManifest::isValid() const
+{
+    if (chunkSize <= 0 || length <= 0)
+        return false;
+
+    return sha512.size() == (length + chunkSize - 1) / chunkSize;
+}
+
+ChunkManifest ChunkManifest::fromJson(const QJsonObject &json)
+{
+    ChunkManifest manifest;
+
+    manifest.chunkSize = (qint64) json["size"].toDouble();
+    manifest.length = (qint64) json["length"].toDouble();
+
+    foreach (const QJsonValue &v, json["sha512"].toArray())
+        manifest.sha512 << v.toString();
+
+    return manifest;
+}
+
+ChunkedDownloader::ChunkedDownloader(const QUrl &url, BlockDevice *output, const ChunkManifest &manifest,
+                                     int connections, QObject *parent) :
+    QObject(parent),
+    url(url),
+    output(output),
+    connections(connections),
+    totalLength(0),
+    networkAccessManager(this),
+    loop(this),
+    stallTimer(this),
+    active(0),
+    completed(0),
+    error(false),
+    bytesReceived(0)
+{
+    if (manifest.isValid())
+        for (int i = 0; i < manifest.sha512.size(); i++) {
+            qint64 offset = i * manifest.chunkSize;
+            addChunk(offset, qMin(manifest.chunkSize, manifest.length - offset), manifest.sha512[i]);
+        }
+}
+
+ChunkedDownloader::ChunkedDownloader(const QUrl &url, BlockDevice *output, const QList<QPair<qint64, qint64> > &ranges,
+                                     int connections, QObject *parent) :
+    QObject(parent),
+    url(url),
+    output(output),
+    connections(connections),
+    totalLength(0),
+    networkAccessManager(this),
+    loop(this),
+    stallTimer(this),
+    active(0),
+    completed(0),
+    error(false),
+    bytesReceived(0)
+{
+    for (int i = 0; i < ranges.size(); i++)
+        addChunk(ranges[i].first, ranges[i].second, QString());
+}
+
+void ChunkedDownloader::addChunk(qint64 offset, qint64 length, const QString &sha512)
+{
+    Chunk chunk;
+
+    chunk.offset = offset;
+    chunk.length = length;
+    chunk.received = 0;
+    chunk.attempts = 0;
+    chunk.sha512 = sha512;
+    chunk.reply = NULL;
+
+    pending.enqueue(chunks.size());
+    chunks.append(chunk);
+    totalLength += length;
+}
+
+bool ChunkedDownloader::download()
+{
+    if (chunks.isEmpty()) {
+        qWarning(ChunkedDownloaderLog) << "Nothing to download from" << url;
+        return false;
+    }
+
+    for (int i = 0; i < chunks.size(); i++)
+        if (chunks[i].offset + chunks[i].length > output->maxSize()) {
+            qWarning(ChunkedDownloaderLog) << "Chunk at offset" << chunks[i].offset << "does not fit on"
+                                           << output->fileName();
+            return false;
+        }
+
+    // Abort all transfers if nothing was received for a while. The affected
+    // chunks are retried.
+    stallTimer.setSingleShot(true);
+    QObject::connect(&stallTimer, &QTimer::timeout, [this]() {
+        qInfo(ChunkedDownloaderLog) << "Download of" << url << "stalled, aborting active chunks";
+
+        for (int i = 0; i < chunks.size(); i++)
+            if (chunks[i].reply)
+                chunks[i].reply->abort();
+    });
+
+    qInfo(ChunkedDownloaderLog) << "Downloading" << url << "in" << chunks.size() << "chunks over"
+                                << connections << "connections";
+
+    networkAccessManager.setNetworkAccessible(QNetworkAccessManager::Accessible);
+
+    startChunks();
+    stallTimer.start(stallTimeoutMs);
+
+    if (!error && completed < chunks.size())
+        loop.exec();
+
+    stallTimer.stop();
+
+    if (error)
+        return false;
+
+    return output->sync();
+}
+
+void ChunkedDownloader::startChunks()
+{
+    while (!error && active < connections && !pending.isEmpty()) {
+        int index = pending.dequeue();
+        Chunk &chunk = chunks[index];
+
+        chunk.received = 0;
+        chunk.attempts++;
+        chunk.hash.reset();
+
+        QNetworkRequest request(url);
+        request.setAttribute(QNetworkRequest::SpdyAllowedAttribute, true);
+        request.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, true);
+        request.setRawHeader("Range", "bytes=" + QByteArray::number(chunk.offset) + "-" +
+                             QByteArray::number(chunk.offset + chunk.length - 1));
+
+        chunk.reply = networkAccessManager.get(request);
+        chunk.reply->setReadBufferSize(256 * 1024);
+
+        QObject::connect(chunk.reply, &QNetworkReply::readyRead, [this, index]() {
+            chunkReadyRead(index);
+        });
+
+        QObject::connect(chunk.reply, &QNetworkReply::finished, [this, index]() {
+            chunkFinished(index);
+        });
+
+        active++;
+    }
+}
+
+void ChunkedDownloader::chunkReadyRead(int index)
+{
+    Chunk &chunk = chunks[index];
+    QNetworkReply *reply = chunk.reply;
+
+    // Anything but partial content fails this attempt, and the chunk is
+    // retried like after a transfer error
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 206) {
+        qInfo(ChunkedDownloaderLog) << "Server did not honor range request for chunk" << index << "of" << url;
+        reply->abort();
+        return;
+    }
+
+    const QByteArray data = reply->readAll();
+
+    if (chunk.received + data.size() > chunk.length) {
+        qInfo(ChunkedDownloaderLog) << "Server sent excess data for chunk" << index;
+        reply->abort();
+        return;
+    }
+
+    if (output->writeAt(data.constData(), data.size(), chunk.offset + chunk.received) != data.size()) {
+        fail();
+        return;
+    }
+
+    chunk.hash.addData(data.constData(), data.size());
+    chunk.received += data.size();
+    bytesReceived += data.size();
+
+    stallTimer.start(stallTimeoutMs);
+    emit progress(bytesReceived, totalLength);
+}
+
+void ChunkedDownloader::chunkFinished(int index)
+{
+    Chunk &chunk = chunks[index];
+    QNetworkReply *reply = chunk.reply;
+
+    chunk.reply = NULL;
+    reply->deleteLater();
+    active--;
+
+    if (error)
+        return;
+
+    bool ok = reply->error() == QNetworkReply::NoError && chunk.received == chunk.length;
+
+    if (ok && !chunk.sha512.isEmpty() && chunk.hash.result().toHex() != chunk.sha512) {
+        qInfo(ChunkedDownloaderLog) << "Checksum mismatch for chunk" << index << "of" << url;
+        ok = false;
+    }
+
+    if (ok) {
+        completed++;
+
+        if (completed == chunks.size()) {
+            loop.quit();
+            return;
+        }
+    } else {
+        bytesReceived -= chunk.received;
+
+        if (chunk.attempts >= maxAttempts) {
+            qInfo(ChunkedDownloaderLog) << "Giving up on chunk" << index << "of" << url << ":" << reply->errorString();
+            fail();
+            return;
+        }
+
+        qInfo(ChunkedDownloaderLog) << "Retrying chunk" << index << "of" << url;
+        pending.enqueue(index);
+    }
+
+    startChunks();
+}
+
+void ChunkedDownloader::fail()
+{
+    if (error)
+        return;
+
+    error = true;
+
+    for (int i = 0; i < chunks.size(); i++)
+        if (chunks[i].reply)
+            chunks[i].reply->abort();
+
+    loop.quit();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <QObject>
+#include <QUrl>
+#include <QQueue>
+#include <QVector>
+#include <QTimer>
+#include <QEventLoop>
+#include <QStringList>
+#include <QJsonObject>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QtCore/QLoggingCategory>
+
+#include "blockdevice.h"
+#include "sha512.h"
+
+Q_DECLARE_LOGGING_CATEGORY(ChunkedDownloaderLog)
+
+//
+// Per-chunk SHA512 sums of a full image as published in the update Json:
+//
+//   "rootfs_chunks": { "size": <chunk size>, "length": <image length>, "sha512": [ ... ] }
+//
+
+struct ChunkManifest {
+    qint64 chunkSize;
+    qint64 length;
+    QStringList sha512;
+
+    ChunkManifest() : chunkSize(0), length(0) {}
+    bool isValid() const;
+    static ChunkManifest fromJson(const QJsonObject &json);
+};
+
+//
+// ChunkedDownloader fetches an image with several concurrent HTTP range requests
+// and writes each chunk at its offset in the output device as data arrives.
+// Every chunk is verified against the manifest and retried on its own if the
+// transfer fails or the checksum doesn't match.
+//
+// Alternatively, an arbitrary list of (offset, length) ranges can be fetched. In
+// that case, the caller is responsible for verifying the data.
+//
+
+class ChunkedDownloader : public QObject
+{
+    Q_OBJECT
+
+public:
+    ChunkedDownloader(const QUrl &url, BlockDevice *output, const ChunkManifest &manifest,
+                      int connections = 4, QObject *parent = 0);
+    ChunkedDownloader(const QUrl &url, BlockDevice *output, const QList<QPair<qint64, qint64> > &ranges,
+                      int connections = 4, QObject *parent = 0);
+
+    bool download();
+
+    // Gives up on the download, download() then returns false
+    void abort() { fail(); }
+
+signals:
+    void progress(qint64 bytesReceived, qint64 bytesTotal);
+
+private:
+    static const int maxAttempts = 3;
+    static const int stallTimeoutMs = 60 * 1000;
+
+    struct Chunk {
+        qint64 offset;
+        qint64 length;
+        qint64 received;
+        int attempts;
+        QString sha512;
+        Sha512 hash;
+        QNetworkReply *reply;
+    };
+
+    QUrl url;
+    BlockDevice *output;
+    int connections;
+    qint64 totalLength;
+
+    QNetworkAccessManager networkAccessManager;
+    QEventLoop loop;
+    QTimer stallTimer;
+    QVector<Chunk> chunks;
+    QQueue<int> pending;
+    int active;
+    int completed;
+    bool error;
+    qint64 bytesReceived;
+
+    void addChunk(qint64 offset, qint64 length, const QString &sha512);
+    void startChunks();
+    void chunkReadyRead(int index);
+    void chunkFinished(int index);
+    void fail();
+};
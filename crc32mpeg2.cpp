@@ -0,0 +1,222 @@
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "crc32mpeg2.h"
+
+static const uint32_t polynomial = 0x04c11db7;
+
+//
+// Slice-by-8 tables. Entry i of table n is the CRC of byte i followed by n
+// zero bytes, so eight bytes are folded into the register with eight lookups.
+// The tables are generated by the compiler; C++11 constexpr functions can't
+// loop, hence the recursion and the index pack.
+//
+
+static constexpr uint32_t shiftBits(uint32_t crc, int bits)
+{
+    return bits == 0 ? crc : shiftBits((crc & 0x80000000) ? (crc << 1) ^ polynomial : crc << 1, bits - 1);
+}
+
+static constexpr uint32_t shiftByte(uint32_t crc)
+{
+    return (crc << 8) ^ shiftBits(crc & 0xff000000, 8);
+}
+
+static constexpr uint32_t sliceEntry(int table, uint32_t i)
+{
+    return table == 0 ? shiftBits(i << 24, 8) : shiftByte(sliceEntry(table - 1, i));
+}
+
+template<int... I> struct Indices {};
+template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> Type; };
+
+struct SliceTables {
+    uint32_t t[8][256];
+};
+
+template<int... I>
+static constexpr SliceTables makeSliceTables(Indices<I...>)
+{
+    return SliceTables {{
+        { sliceEntry(0, I)... }, { sliceEntry(1, I)... }, { sliceEntry(2, I)... }, { sliceEntry(3, I)... },
+        { sliceEntry(4, I)... }, { sliceEntry(5, I)... }, { sliceEntry(6, I)... }, { sliceEntry(7, I)... },
+    }};
+}
+
+static constexpr SliceTables slice = makeSliceTables(MakeIndices<256>::Type());
+
+static_assert(slice.t[0][1] == polynomial, "CRC table generation is broken");
+static_assert(slice.t[0][255] == 0xb1f740b4, "CRC table generation is broken");
+
+static inline uint32_t loadLE32(const char *p)
+{
+    const uint8_t *b = (const uint8_t *) p;
+
+    return (uint32_t) b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static uint32_t updateBytewise(uint32_t crc, const char *buf, size_t len)
+{
+    const uint32_t *t0 = slice.t[0];
+
+    for (; len >= 4; len -= 4, buf += 4) {
+        crc = (crc << 8) ^ t0[((crc >> 24) ^ buf[3]) & 0xff];
+        crc = (crc << 8) ^ t0[((crc >> 24) ^ buf[2]) & 0xff];
+        crc = (crc << 8) ^ t0[((crc >> 24) ^ buf[1]) & 0xff];
+        crc = (crc << 8) ^ t0[((crc >> 24) ^ buf[0]) & 0xff];
+    }
+
+    return crc;
+}
+
+static uint32_t updateSlice8(uint32_t crc, const char *buf, size_t len)
+{
+    const uint32_t (*t)[256] = slice.t;
+
+    // The first word is shifted in MSB first, so it lines up with the
+    // register as loaded.
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint32_t a = crc ^ loadLE32(buf);
+        uint32_t b = loadLE32(buf + 4);
+
+        crc = t[7][a >> 24] ^ t[6][(a >> 16) & 0xff] ^ t[5][(a >> 8) & 0xff] ^ t[4][a & 0xff] ^
+              t[3][b >> 24] ^ t[2][(b >> 16) & 0xff] ^ t[1][(b >> 8) & 0xff] ^ t[0][b & 0xff];
+    }
+
+    if (len >= 4) {
+        uint32_t a = crc ^ loadLE32(buf);
+
+        crc = t[3][a >> 24] ^ t[2][(a >> 16) & 0xff] ^ t[1][(a >> 8) & 0xff] ^ t[0][a & 0xff];
+    }
+
+    return crc;
+}
+
+#if defined(__aarch64__)
+//
+// The CRC32 instructions compute the bit reflected CRC with the same
+// polynomial, shifting in the LSB of their operand first. Reversing the bits
+// of the register and of every word turns that into the MSB first CRC. For
+// CRC32X the two words of a doubleword are swapped, as the first word must
+// end up in the upper half after reversal.
+//
+static inline uint32_t rbit32(uint32_t v)
+{
+    __asm__("rbit %w0, %w1" : "=r" (v) : "r" (v));
+    return v;
+}
+
+static inline uint64_t rbit64(uint64_t v)
+{
+    __asm__("rbit %x0, %x1" : "=r" (v) : "r" (v));
+    return v;
+}
+
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t updateArmv8(uint32_t crc, const char *buf, size_t len)
+{
+    uint32_t r = rbit32(crc);
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t d = ((uint64_t) loadLE32(buf) << 32) | loadLE32(buf + 4);
+
+        r = __crc32d(r, rbit64(d));
+    }
+
+    if (len >= 4)
+        r = __crc32w(r, rbit32(loadLE32(buf)));
+
+    return rbit32(r);
+}
+#endif
+
+struct Crc32Backend {
+    const char *name;
+    uint32_t (*update)(uint32_t crc, const char *buf, size_t len);
+};
+
+static const Crc32Backend backends[] = {
+    { "bytewise", updateBytewise },
+    { "slice8", updateSlice8 },
+#if defined(__aarch64__)
+    { "armv8", updateArmv8 },
+#endif
+};
+
+static const int numBackends = sizeof(backends) / sizeof(backends[0]);
+
+static bool backendSupported(const Crc32Backend &b)
+{
+#if defined(__aarch64__)
+    if (b.update == updateArmv8 && !(getauxval(AT_HWCAP) & HWCAP_CRC32))
+        return false;
+#endif
+
+    // A CRC that disagrees with the firmware's would fail every update
+    char data[60];
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i * 7 + 3;
+
+    return b.update(Crc32Mpeg2::initialValue, data, sizeof(data)) ==
+            updateBytewise(Crc32Mpeg2::initialValue, data, sizeof(data));
+}
+
+static const Crc32Backend *defaultBackend()
+{
+    // The last supported entry is the fastest one
+    for (int i = numBackends - 1; i > 0; i--)
+        if (backendSupported(backends[i]))
+            return &backends[i];
+
+    return &backends[0];
+}
+
+static const Crc32Backend *currentBackend(const Crc32Backend *select = NULL)
+{
+    static const Crc32Backend *current = defaultBackend();
+
+    if (select)
+        current = select;
+
+    return current;
+}
+
+uint32_t Crc32Mpeg2::update(uint32_t crc, const char *data, size_t length)
+{
+    return currentBackend()->update(crc, data, length);
+}
+
+QString Crc32Mpeg2::backend()
+{
+    return currentBackend()->name;
+}
+
+QStringList Crc32Mpeg2::availableBackends()
+{
+    QStringList names;
+
+    for (int i = 0; i < numBackends; i++)
+        if (backendSupported(backends[i]))
+            names << backends[i].name;
+
+    return names;
+}
+
+bool Crc32Mpeg2::setBackend(const QString &name)
+{
+    for (int i = 0; i < numBackends; i++) {
+        if (name == backends[i].name && backendSupported(backends[i])) {
+            currentBackend(&backends[i]);
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <QStringList>
+
+#include <stdint.h>
+
+//
+// CRC32-MPEG2 as computed by the STM32 CRC unit: polynomial 0x04c11db7, no
+// bit reflection and no final XOR. The unit is fed 32 bit words, so data is
+// consumed as little endian words that are each shifted in MSB first. Lengths
+// must be a multiple of 4; trailing bytes are ignored.
+//
+// The implementation is picked at runtime by CPU features: CRC32 instructions
+// on ARMv8, slice-by-8 over tables generated at compile time otherwise. The
+// byte at a time loop is kept as a reference.
+//
+
+class Crc32Mpeg2
+{
+public:
+    static const uint32_t initialValue = 0xffffffff;
+
+    static uint32_t update(uint32_t crc, const char *data, size_t length);
+    static uint32_t checksum(const char *data, size_t length) { return update(initialValue, data, length); }
+
+    static QString backend();
+    static QStringList availableBackends();
+    static bool setBackend(const QString &name);
+};
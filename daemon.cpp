@@ -44,6 +44,7 @@ Daemon::Daemon(QUrl uri, QObject *parent) :
     machine(new Machine(this)),
     mediaCtl(new MediaCtl(0, this)),
     fring(new Fring()),
+    fringThread(new QThread(this)),
     kirby(new KirbyConnection(uri, this)),
     updater(new Updater(machine, this)),
     nfc(new Nfc(this)),
@@ -229,64 +230,75 @@ bool Daemon::init()
     if (machine->eligibleForUpdate())
             fring->enableFirmwareUpdates();
 
-    if (fring->initialize()) {
-        QObject::connect(fring, &Fring::homeButtonChanged, [this](bool state) {
-            KirbyMessage msg("policy/homebutton/STATE_CHANGED", QJsonObject {
-                                 { "id", "home" },
-                                 { "state", state },
-                             });
-            kirby->sendMessage(msg);
-        });
-
-        QObject::connect(fring, &Fring::batteryStateChanged, [this](double level, double chargeCurrent, double temperature, double timeToEmpty, double timeToFull) {
-            KirbyMessage msg("policy/battery/STATE_CHANGED", QJsonObject {
-                                 { "level", level },
-                                 { "chargingCurrent", chargeCurrent },
-                                 { "temperature", temperature },
-                                 { "timeToEmpty", timeToEmpty },
-                                 { "timeToFull", timeToFull },
-                             });
-            kirby->sendMessage(msg);
-        });
+    QObject::connect(fring, &Fring::homeButtonChanged, this, [this](bool state) {
+        KirbyMessage msg("policy/homebutton/STATE_CHANGED", QJsonObject {
+                             { "id", "home" },
+                             { "state", state },
+                         });
+        kirby->sendMessage(msg);
+    });
 
-        QObject::connect(fring, &Fring::ambientLightChanged, [this](double value) {
-            KirbyMessage msg("policy/display/AMBIENT_LIGHT_CHANGED", QJsonObject {
-                                 { "value", value },
-                             });
-            kirby->sendMessage(msg);
-        });
-
-        QObject::connect(fring, &Fring::hardwareErrorsChanged, this, &Daemon::sendDeviceInformation);
-
-        QObject::connect(fring, &Fring::wakeupReasonChanged, [this](Fring::WakeupReason reason) {
-            QString strReason = "unknown";
-            //TODO: How do we behave in these cases?!
-            if (reason == Fring::WAKEUP_REASON_RTC) {
-                strReason = "rtc";
-                connman->resume();
-
-            } else if (reason == Fring::WAKEUP_REASON_HOMEBUTTON) {
-                strReason = "homebutton";
-                connman->resume();
-                displayBrightness->resume();
-                nubbock->resume();
-            }
+    QObject::connect(fring, &Fring::batteryStateChanged, this, [this](double level, double chargeCurrent, double temperature, double timeToEmpty, double timeToFull) {
+        KirbyMessage msg("policy/battery/STATE_CHANGED", QJsonObject {
+                             { "level", level },
+                             { "chargingCurrent", chargeCurrent },
+                             { "temperature", temperature },
+                             { "timeToEmpty", timeToEmpty },
+                             { "timeToFull", timeToFull },
+                         });
+        kirby->sendMessage(msg);
+    });
 
-            KirbyMessage msg("policy/power-management/RESUMED", QJsonObject {
-                                 { "wakeupReason", strReason },
-                             });
+    QObject::connect(fring, &Fring::ambientLightChanged, this, [this](double value) {
+        KirbyMessage msg("policy/display/AMBIENT_LIGHT_CHANGED", QJsonObject {
+                             { "value", value },
+                         });
+        kirby->sendMessage(msg);
+    });
 
-            qInfo(DaemonLog) << "Wakeup reason: " << strReason;
+    QObject::connect(fring, &Fring::hardwareErrorsChanged, this, &Daemon::sendDeviceInformation);
 
-            kirby->sendMessage(msg);
-        });
+    QObject::connect(fring, &Fring::wakeupReasonChanged, this, [this](Fring::WakeupReason reason) {
+        QString strReason = "unknown";
+        //TODO: How do we behave in these cases?!
+        if (reason == Fring::WAKEUP_REASON_RTC) {
+            strReason = "rtc";
+            connman->resume();
 
-        QObject::connect(fring, &Fring::logMessageReceived, [this](const QString &message) {
-            qInfo(DaemonLog) << "Message from fring:" << message;
-        });
+        } else if (reason == Fring::WAKEUP_REASON_HOMEBUTTON) {
+            strReason = "homebutton";
+            connman->resume();
+            displayBrightness->resume();
+            nubbock->resume();
+        }
 
+        KirbyMessage msg("policy/power-management/RESUMED", QJsonObject {
+                             { "wakeupReason", strReason },
+                         });
+
+        qInfo(DaemonLog) << "Wakeup reason: " << strReason;
+
+        kirby->sendMessage(msg);
+    });
+
+    QObject::connect(fring, &Fring::logMessageReceived, this, [this](const QString &message) {
+        qInfo(DaemonLog) << "Message from fring:" << message;
+    });
+
+    // Interrupts are serviced on a thread of their own, so they don't queue
+    // up behind websocket traffic. Everything is connected before the thread
+    // starts, so no signal emitted during initialization gets lost.
+    bool fringInitialized = false;
+
+    fring->moveToThread(fringThread);
+    QObject::connect(fringThread, &QThread::finished, fring, &QObject::deleteLater);
+    fringThread->start();
+
+    QMetaObject::invokeMethod(fring, "initialize", Qt::BlockingQueuedConnection,
+                              Q_RETURN_ARG(bool, fringInitialized));
+
+    if (fringInitialized)
         machine->setDeviceSerial(fring->getDeviceSerial());
-    }
 
     if (!mediaCtl->initialize())
         qWarning(DaemonLog) << "MediaCtl failed to initialize";
@@ -434,6 +446,7 @@ void Daemon::kirbyMessageReceived(const KirbyMessage &message)
         // Set wakeuptime in any case (0 = disabled), since fring also sets
         // its som_state to SUSPENDED, based on that call.
         fring->setWakeupMs(wakeupMs);
+        fring->flushCommands();
 
         connman->suspend();
         nubbock->suspend();
@@ -458,4 +471,6 @@ void Daemon::kirbyMessageReceived(const KirbyMessage &message)
 
 Daemon::~Daemon()
 {
+    fringThread->quit();
+    fringThread->wait();
 }
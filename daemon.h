@@ -62,6 +62,7 @@ private:
     Machine *machine;
     MediaCtl *mediaCtl;
     Fring *fring;
+    QThread *fringThread;
     KirbyConnection *kirby;
     Updater *updater;
     Nfc *nfc;
@@ -0,0 +1,123 @@
+#include <QHash>
+#include <QSet>
+#include <QJsonObject>
+
+#include "deltaplanner.h"
+
+Q_LOGGING_CATEGORY(DeltaPlannerLog, "DeltaPlanner")
+
+QList<Delta> Delta::listFromJson(const QJsonArray &json)
+{
+    QList<Delta> list;
+
+    foreach (const QJsonValue &value, json) {
+        QJsonObject object = value.toObject();
+        Delta delta;
+
+        delta.from = object["from"].toString();
+        delta.to = object["to"].toString();
+        delta.url = QUrl(object["url"].toString());
+        delta.size = (qint64) object["size"].toDouble();
+
+        if (delta.from.isEmpty() || delta.to.isEmpty() || !delta.url.isValid())
+            continue;
+
+        // A delta without a size would look free and draw routes through
+        // it, and negative costs break the search
+        if (delta.size <= 0) {
+            qInfo(DeltaPlannerLog) << "Ignoring delta from" << delta.from << "to" << delta.to
+                                   << "with size" << delta.size;
+            continue;
+        }
+
+        list.append(delta);
+    }
+
+    return list;
+}
+
+DeltaPlanner::DeltaPlanner(const QList<Delta> &deltas, qint64 imageLength, qint64 intermediateLimit) :
+    deltas(deltas),
+    imageLength(imageLength),
+    intermediateLimit(intermediateLimit)
+{
+}
+
+qint64 DeltaPlanner::cost(const Delta &delta) const
+{
+    return delta.size + imageLength / DeltaPlanner::decodeCostDivisor;
+}
+
+QList<Delta> DeltaPlanner::plan(const QString &from, const QString &to) const
+{
+    bool chains = imageLength > 0 && imageLength <= intermediateLimit;
+
+    // Dijkstra over builds. The graphs are tiny, so a linear scan for the
+    // closest unvisited build will do.
+    QHash<QString, qint64> distance;
+    QHash<QString, int> via;
+    QSet<QString> visited;
+
+    distance[from] = 0;
+
+    forever {
+        QString current;
+        qint64 best = -1;
+
+        for (QHash<QString, qint64>::const_iterator it = distance.constBegin(); it != distance.constEnd(); ++it) {
+            if (!visited.contains(it.key()) && (best < 0 || it.value() < best)) {
+                current = it.key();
+                best = it.value();
+            }
+        }
+
+        if (best < 0 || current == to)
+            break;
+
+        visited.insert(current);
+
+        // Without room for an intermediate image, only direct deltas count
+        if (!chains && current != from)
+            continue;
+
+        for (int i = 0; i < deltas.size(); i++) {
+            const Delta &delta = deltas[i];
+
+            if (delta.from != current || (!chains && delta.to != to))
+                continue;
+
+            qint64 d = best + cost(delta);
+
+            if (!distance.contains(delta.to) || d < distance[delta.to]) {
+                distance[delta.to] = d;
+                via[delta.to] = i;
+            }
+        }
+    }
+
+    QList<Delta> route;
+
+    if (!distance.contains(to) || from == to) {
+        qInfo(DeltaPlannerLog) << "No delta route from" << from << "to" << to;
+        return route;
+    }
+
+    for (QString build = to; build != from; build = deltas[via[build]].from)
+        route.prepend(deltas[via[build]]);
+
+    qint64 bytes = 0;
+    foreach (const Delta &delta, route)
+        bytes += delta.size;
+
+    // The full image costs its length to download, and nothing to decode
+    if (imageLength > 0 && distance[to] >= imageLength) {
+        qInfo(DeltaPlannerLog) << "Best delta route from" << from << "to" << to << "has" << route.size()
+                               << "steps and" << bytes << "bytes, full image is cheaper";
+        return QList<Delta>();
+    }
+
+    qInfo(DeltaPlannerLog) << "Using" << route.size() << "deltas from" << from << "to" << to << ":"
+                           << bytes << "bytes, estimated cost" << distance[to] << "of" << imageLength;
+
+    return route;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <QUrl>
+#include <QList>
+#include <QString>
+#include <QJsonArray>
+#include <QtCore/QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(DeltaPlannerLog)
+
+//
+// Deltas available for an image as published in the update Json:
+//
+//   "rootfs_delta_index": [ { "from": "<build id>", "to": "<build id>",
+//                             "url": "<vcdiff url>", "size": <bytes> }, ... ]
+//
+// A size of 0 means unknown, which is what deltas from manifests without an
+// index get.
+//
+
+struct Delta {
+    QString from;
+    QString to;
+    QUrl url;
+    qint64 size;
+
+    Delta() : size(0) {}
+    static QList<Delta> listFromJson(const QJsonArray &json);
+};
+
+//
+// DeltaPlanner finds the cheapest route from the installed build to the new
+// one through the published deltas. Every delta costs its download size plus
+// a fraction of the image length for decoding it, and the route is compared
+// against downloading the full image. Routes of more than one delta need room
+// for an intermediate image, so they're only considered when the image length
+// is known and within the given limit.
+//
+
+class DeltaPlanner
+{
+public:
+    DeltaPlanner(const QList<Delta> &deltas, qint64 imageLength, qint64 intermediateLimit);
+
+    QList<Delta> plan(const QString &from, const QString &to) const;
+
+private:
+    // Decoding a delta reads the dictionary and writes a whole image, which
+    // costs about as much as downloading an eighth of it.
+    static const int decodeCostDivisor = 8;
+
+    QList<Delta> deltas;
+    qint64 imageLength;
+    qint64 intermediateLimit;
+
+    qint64 cost(const Delta &delta) const;
+};
@@ -0,0 +1,93 @@
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QJsonObject>
+#include <QJsonDocument>
+
+#include "downloadjournal.h"
+
+Q_LOGGING_CATEGORY(DownloadJournalLog, "DownloadJournal")
+
+const QString DownloadJournal::directory = "/var/lib/kalami";
+
+DownloadJournal::DownloadJournal(const QUrl &url, const QString &target, const QString &sha512) :
+    url(url), target(target), sha512(sha512), path(journalPath(target)), bytesDone(0), state()
+{
+}
+
+QString DownloadJournal::journalPath(const QString &target)
+{
+    return directory + "/download-journal-" + QFileInfo(target).fileName() + ".json";
+}
+
+bool DownloadJournal::load()
+{
+    bytesDone = 0;
+    state.clear();
+
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+    if (!doc.isObject())
+        return false;
+
+    QJsonObject json = doc.object();
+
+    if (json["url"].toString() != url.toString() ||
+        json["target"].toString() != target ||
+        json["sha512"].toString() != sha512)
+        return false;
+
+    bytesDone = json["offset"].toString().toLongLong();
+    state = QByteArray::fromBase64(json["hash_state"].toString().toLatin1());
+
+    qInfo(DownloadJournalLog) << "Found journal for" << target << "at offset" << bytesDone;
+
+    return bytesDone > 0;
+}
+
+bool DownloadJournal::checkpoint(qint64 offset, const QByteArray &hashState)
+{
+    QDir().mkpath(directory);
+
+    QJsonObject json {
+        { "url", url.toString() },
+        { "target", target },
+        { "sha512", sha512 },
+        { "offset", QString::number(offset) },
+        { "hash_state", QString::fromLatin1(hashState.toBase64()) },
+    };
+
+    QSaveFile file(path);
+    if (!file.open(QFile::WriteOnly)) {
+        qWarning(DownloadJournalLog) << "Unable to write" << path << ":" << file.errorString();
+        return false;
+    }
+
+    file.write(QJsonDocument(json).toJson(QJsonDocument::Compact));
+    if (!file.commit()) {
+        qWarning(DownloadJournalLog) << "Unable to commit" << path << ":" << file.errorString();
+        return false;
+    }
+
+    bytesDone = offset;
+    state = hashState;
+
+    return true;
+}
+
+void DownloadJournal::clear()
+{
+    bytesDone = 0;
+    state.clear();
+    QFile::remove(path);
+}
+
+void DownloadJournal::invalidate(const QString &target)
+{
+    // The recorded bytes are about to be overwritten by something else
+    QFile::remove(journalPath(target));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QUrl>
+#include <QString>
+#include <QByteArray>
+#include <QtCore/QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(DownloadJournalLog)
+
+//
+// DownloadJournal persists the progress of a full image download, so it can be
+// resumed with a HTTP range request after network errors or timeouts. An entry
+// records how many bytes of the image have been written and synced to the target
+// device, along with the SHA512 state over exactly these bytes. It only matches
+// a download with the same URL, target device and expected checksum. Each
+// target device has its own journal, so concurrent downloads don't clash.
+//
+
+class DownloadJournal
+{
+public:
+    DownloadJournal(const QUrl &url, const QString &target, const QString &sha512);
+
+    bool load();
+    bool checkpoint(qint64 offset, const QByteArray &hashState);
+    void clear();
+
+    qint64 offset() const { return bytesDone; }
+    const QByteArray &hashState() const { return state; }
+
+    static void invalidate(const QString &target);
+
+private:
+    static const QString directory;
+
+    static QString journalPath(const QString &target);
+
+    QUrl url;
+    QString target;
+    QString sha512;
+    QString path;
+    qint64 bytesDone;
+    QByteArray state;
+};
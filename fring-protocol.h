@@ -17,6 +17,33 @@ enum {
     FRING_REG_SET_SERIAL                  = 0x0b,
     FRING_REG_SET_WAKEUP_TIME             = 0x0c,
     FRING_REG_READ_WAKEUP_REASON          = 0x0d,
+    FRING_REG_READ_STATUS                 = 0x0e,
+};
+
+//
+// Protocol versions. The host announces the highest version it speaks in the
+// FRING_REG_ID command. Firmware that supports version 2 or later answers with
+// a ProtocolInfo instead of a bare Id, carrying the version it agreed on.
+//
+// Version 2 pushes firmware updates in chunks of up to maxChunkSize bytes, of
+// which up to window may be outstanding. Completed chunks are acknowledged
+// cumulatively by the chunk count in UpdateAck.
+//
+// Version 3 adds FRING_REG_READ_STATUS, which returns the interrupt status
+// together with the device status and wakeup reason in one Status burst,
+// protected by a CRC32-MPEG2 over the words before it. Reading it clears the
+// device status and wakeup interrupts. Other interrupts stay set in the
+// returned status and their registers are read as before.
+//
+
+enum {
+    FRING_PROTOCOL_VERSION_1              = 1,
+    FRING_PROTOCOL_VERSION_2              = 2,
+    FRING_PROTOCOL_VERSION_3              = 3,
+};
+
+enum {
+    FRING_STATUS_VERSION_1                = 1,
 };
 
 enum {
@@ -69,6 +96,14 @@ struct Id {
     uint8_t id[5];
 } _packed_;
 
+struct ProtocolInfo {
+    uint8_t id[5];
+    uint8_t version;
+    uint16_t maxChunkSize;
+    uint8_t window;
+    uint8_t reserved;
+} _packed_;
+
 struct BootInfo {
     uint32_t version;
     uint32_t uptime;
@@ -112,20 +147,37 @@ struct UpdateStatus {
     uint32_t status;
 } _packed_;
 
+struct UpdateAck {
+    uint32_t status;
+    uint32_t chunks;
+} _packed_;
+
 struct WakeupReason {
     uint32_t reason;
 } _packed_;
 
+struct Status {
+    uint8_t version;
+    uint8_t reserved[3];
+    InterruptStatus interruptStatus;
+    DeviceStatus deviceStatus;
+    WakeupReason wakeupReason;
+    uint32_t crc;
+} _packed_;
+
 struct CommandRead {
     union {
         Id id;
+        ProtocolInfo protocolInfo;
         BootInfo bootInfo;
         BoardRevision boardRevision;
         InterruptStatus interruptStatus;
         DeviceStatus deviceStatus;
         BatteryStatus batteryStatus;
         UpdateStatus updateStatus;
+        UpdateAck updateAck;
         WakeupReason wakeupReason;
+        Status status;
 
         uint8_t unused[0];
     };
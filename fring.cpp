@@ -1,12 +1,14 @@
 #include <QtEndian>
 #include <QDir>
+#include <QMutexLocker>
 #include <QThread>
 #include <QTime>
 #include <QTimer>
+#include <QQueue>
 
 #include "fring.h"
 #include "gpio.h"
-#include "crc32table.h"
+#include "crc32mpeg2.h"
 
 #include <math.h>
 
@@ -15,15 +17,32 @@ Q_LOGGING_CATEGORY(FringLog, "Fring")
 const int Fring::GPIONr = 8;
 const int Fring::I2CBus = 0;
 const int Fring::I2CAddr = 0x42;
+const int Fring::hostProtocolVersion = FringProtocol::FRING_PROTOCOL_VERSION_3;
+const int Fring::maxUpdateChunkSize = 1024;
+const int Fring::maxUpdateWindow = 16;
+
+// Firmware update chunks of protocol version 1
+static const int updateChunkSizeV1 = 32;
 
 Fring::Fring(QObject *parent) :
     QObject(parent),
     client(this),
     interruptGpio(Fring::GPIONr, this),
+    boardRevisionA(0),
+    boardRevisionB(0),
     firmwareUpdatesEnabled(false),
+    protocolVersion(FringProtocol::FRING_PROTOCOL_VERSION_1),
+    updateChunkSize(updateChunkSizeV1),
+    updateWindow(1),
     updateThread(0),
-    batteryLogFileName()
+    batteryLogFileName(),
+    processScheduled(0),
+    interruptLatencySum(0),
+    interruptLatencyMax(0),
+    interruptLatencyCount(0)
 {
+    qRegisterMetaType<Fring::WakeupReason>();
+
     interruptGpio.setEdge(GPIO::EdgeFalling);
     interruptGpio.setDirection(GPIO::DirectionIn);
     interruptGpio.setWakeupSource(GPIO::Wakeup);
@@ -58,23 +77,11 @@ bool Fring::initialize()
             return false;
     }
 
-    FringProtocol::CommandRead rdCmd = {};
-    FringProtocol::CommandWrite wrCmd = {};
-
-    wrCmd.reg = FringProtocol::FRING_REG_ID;
-    wrCmd.protocol.version = 1;
-    if (!transfer(&wrCmd, offsetof(FringProtocol::CommandWrite, protocol) + sizeof(wrCmd.protocol),
-                  &rdCmd, sizeof(rdCmd.id)))
+    if (!negotiateProtocol())
         return false;
 
-    if (rdCmd.id.id[0] != 'F' ||
-            rdCmd.id.id[1] != 'r' ||
-            rdCmd.id.id[2] != 'i' ||
-            rdCmd.id.id[3] != 'n' ||
-            rdCmd.id.id[4] != 'g') {
-        qWarning(FringLog) << "Invalid ID code " << QByteArray((char *) rdCmd.id.id, 5);
-        return false;
-    }
+    FringProtocol::CommandRead rdCmd = {};
+    FringProtocol::CommandWrite wrCmd = {};
 
     QStringList bootFlagsStrings;
 
@@ -92,7 +99,7 @@ bool Fring::initialize()
     if (bootFlags & FringProtocol::FRING_BOOT_STATUS_BETA)
         bootFlagsStrings << "beta version";
 
-    firmwareVersion = qFromLittleEndian(rdCmd.bootInfo.version);
+    firmwareVersion.storeRelease(qFromLittleEndian(rdCmd.bootInfo.version));
     QByteArray ba = QByteArray((char *) rdCmd.bootInfo.serial, sizeof(rdCmd.bootInfo.serial));
 
     // Check if the firmware has only 0xff in the serial number, and set a random serial in that case
@@ -113,18 +120,25 @@ bool Fring::initialize()
         transfer(&wrCmd, offsetof(FringProtocol::CommandWrite, serial) + sizeof(wrCmd.serial.serial));
     }
 
+    infoMutex.lock();
     deviceSerial = QString(ba.toHex());
+    infoMutex.unlock();
 
     wrCmd.reg = FringProtocol::FRING_REG_READ_BOARD_REVISION;
     if (!transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.boardRevision)))
         return false;
 
+    infoMutex.lock();
     boardRevisionA = rdCmd.boardRevision.boardRevisionA;
     boardRevisionB = rdCmd.boardRevision.boardRevisionB;
+    infoMutex.unlock();
 
-    qInfo(FringLog) << "Successfully initialized, firmware version" << firmwareVersion
+    qInfo(FringLog) << "Successfully initialized, firmware version" << firmwareVersion.load()
                     << bootFlagsStrings.join(", ")
-                    << "board revisions" << boardRevisionA << boardRevisionB;
+                    << "board revisions" << (int) rdCmd.boardRevision.boardRevisionA
+                    << (int) rdCmd.boardRevision.boardRevisionB;
+
+    processCommands();
 
     if (!firmwareUpdatesEnabled)
         return true;
@@ -134,7 +148,7 @@ bool Fring::initialize()
     QStringList firmwareFiles = firmwareDir.entryList(QDir::Files);
     QString updateSuffix = (bootFlags & FringProtocol::FRING_BOOT_STATUS_FIRMWARE_B) ? "bin-a" : "bin-b";
 
-    int availableVersion = firmwareVersion;
+    int availableVersion = firmwareVersion.load();
     QString newestFirmwareFile;
 
     foreach (QString firmwareFile, firmwareFiles) {
@@ -153,7 +167,7 @@ bool Fring::initialize()
         }
     }
 
-    if (availableVersion > firmwareVersion) {
+    if (availableVersion > firmwareVersion.load()) {
         qInfo(FringLog) << "Newer firmware available (" + newestFirmwareFile + "). Starting update.";
         startFirmwareUpdate(firmwareDir.absolutePath() + "/" + newestFirmwareFile);
     }
@@ -161,11 +175,70 @@ bool Fring::initialize()
     return true;
 }
 
-const QString &Fring::getDeviceSerial()
+bool Fring::negotiateProtocol()
+{
+    FringProtocol::CommandRead rdCmd = {};
+    FringProtocol::CommandWrite wrCmd = {};
+
+    wrCmd.reg = FringProtocol::FRING_REG_ID;
+    wrCmd.protocol.version = Fring::hostProtocolVersion;
+    if (!transfer(&wrCmd, offsetof(FringProtocol::CommandWrite, protocol) + sizeof(wrCmd.protocol),
+                  &rdCmd, sizeof(rdCmd.protocolInfo)))
+        return false;
+
+    if (rdCmd.id.id[0] != 'F' ||
+            rdCmd.id.id[1] != 'r' ||
+            rdCmd.id.id[2] != 'i' ||
+            rdCmd.id.id[3] != 'n' ||
+            rdCmd.id.id[4] != 'g') {
+        qWarning(FringLog) << "Invalid ID code " << QByteArray((char *) rdCmd.id.id, 5);
+        return false;
+    }
+
+    // Version 1 firmware only answers with the Id, so whatever the bus
+    // returns after it must not be taken for a valid protocol info.
+    const FringProtocol::ProtocolInfo &info = rdCmd.protocolInfo;
+    int chunkSize = qFromLittleEndian(info.maxChunkSize);
+
+    protocolVersion = FringProtocol::FRING_PROTOCOL_VERSION_1;
+    updateChunkSize = updateChunkSizeV1;
+    updateWindow = 1;
+
+    if (info.version >= FringProtocol::FRING_PROTOCOL_VERSION_2 && info.version <= Fring::hostProtocolVersion &&
+            chunkSize >= updateChunkSizeV1 && chunkSize <= Fring::maxUpdateChunkSize && chunkSize % 4 == 0 &&
+            info.window >= 1 && info.window <= Fring::maxUpdateWindow) {
+        protocolVersion = info.version;
+        updateChunkSize = chunkSize;
+        updateWindow = info.window;
+    }
+
+    qInfo(FringLog) << "Using protocol version" << protocolVersion << "with firmware update chunks of"
+                    << updateChunkSize << "bytes, window" << updateWindow;
+
+    return true;
+}
+
+QString Fring::getDeviceSerial() const
 {
+    QMutexLocker locker(&infoMutex);
+
     return deviceSerial;
 }
 
+int Fring::getBoardRevisionA() const
+{
+    QMutexLocker locker(&infoMutex);
+
+    return boardRevisionA;
+}
+
+int Fring::getBoardRevisionB() const
+{
+    QMutexLocker locker(&infoMutex);
+
+    return boardRevisionB;
+}
+
 bool Fring::transfer(const FringProtocol::CommandWrite *wrCmd, size_t wrSize,
                      const FringProtocol::CommandRead *rdCmd, size_t rdSize)
 {
@@ -196,7 +269,7 @@ bool Fring::setLed(const FringProtocol::CommandWrite *wrCmd)
     memcpy(&ledCache[id].led, &wrCmd->led, sizeof(wrCmd->led));
     ledCacheValid = true;
 
-    return transfer(wrCmd, offsetof(FringProtocol::CommandWrite, led) + sizeof(wrCmd->led));
+    return queueCommand(wrCmd, offsetof(FringProtocol::CommandWrite, led) + sizeof(wrCmd->led));
 }
 
 bool Fring::setLedOff(int id)
@@ -255,6 +328,46 @@ bool Fring::setLedPulsating(int id, double r, double g, double b, double frequen
     return setLed(&wrCmd);
 }
 
+bool Fring::readStatus(FringProtocol::Status *status)
+{
+    FringProtocol::CommandRead rdCmd = {};
+    FringProtocol::CommandWrite wrCmd = {};
+
+    wrCmd.reg = FringProtocol::FRING_REG_READ_STATUS;
+    if (!transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.status)))
+        return false;
+
+    uint32_t crc = Crc32Mpeg2::checksum((const char *) &rdCmd.status, offsetof(FringProtocol::Status, crc));
+
+    if (rdCmd.status.version != FringProtocol::FRING_STATUS_VERSION_1) {
+        qWarning(FringLog) << "Unknown status version" << rdCmd.status.version;
+        return false;
+    }
+
+    if (crc != qFromLittleEndian(rdCmd.status.crc)) {
+        qWarning(FringLog) << "Status CRC mismatch";
+        return false;
+    }
+
+    *status = rdCmd.status;
+
+    return true;
+}
+
+bool Fring::readInterruptStatus(uint32_t *status)
+{
+    FringProtocol::CommandRead rdCmd = {};
+    FringProtocol::CommandWrite wrCmd = {};
+
+    wrCmd.reg = FringProtocol::FRING_REG_READ_INTERRUPT_STATUS;
+    if (!transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.interruptStatus)))
+        return false;
+
+    *status = qFromLittleEndian(rdCmd.interruptStatus.status);
+
+    return true;
+}
+
 bool Fring::readDeviceStatus()
 {
     FringProtocol::CommandRead rdCmd = {};
@@ -264,7 +377,14 @@ bool Fring::readDeviceStatus()
     if (!transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.deviceStatus)))
         return false;
 
-    uint32_t status = qFromLittleEndian(rdCmd.deviceStatus.status);
+    handleDeviceStatus(rdCmd.deviceStatus);
+
+    return true;
+}
+
+void Fring::handleDeviceStatus(const FringProtocol::DeviceStatus &deviceStatus)
+{
+    uint32_t status = qFromLittleEndian(deviceStatus.status);
 
     bool home = !!(status & FringProtocol::FRING_DEVICE_STATUS_HOME_BUTTON);
 
@@ -274,31 +394,29 @@ bool Fring::readDeviceStatus()
     }
 
     if (ambientLightValue == -1 ||
-            ambientLightValue != rdCmd.deviceStatus.ambientLightValue) {
-        ambientLightValue = rdCmd.deviceStatus.ambientLightValue;
+            ambientLightValue != deviceStatus.ambientLightValue) {
+        ambientLightValue = deviceStatus.ambientLightValue;
         emit ambientLightChanged(ambientLightValue / 255.0);
     }
 
-    uint32_t errors = qFromLittleEndian(rdCmd.deviceStatus.hardwareErrors);
-    if (errors != hardwareErrors) {
+    uint32_t errors = qFromLittleEndian(deviceStatus.hardwareErrors);
+    if (errors != hardwareErrors.load()) {
         if (errors)
             qWarning(FringLog) << "Detected hardware errors: " << QString::number(errors, 16);
 
-        hardwareErrors = errors;
+        hardwareErrors.storeRelease(errors);
         emit hardwareErrorsChanged();
     }
 
-    batteryPresent = !(hardwareErrors & (FringProtocol::FRING_HWERR_BATTERY_NOT_RESPONDING | FringProtocol::FRING_HWERR_BATTERY_INIT_ERROR));
+    batteryPresent = !(errors & (FringProtocol::FRING_HWERR_BATTERY_NOT_RESPONDING | FringProtocol::FRING_HWERR_BATTERY_INIT_ERROR));
 
     qInfo(FringLog) << "Device status upate:";
-    qInfo(FringLog) << QString::asprintf("  Status                : 0x%08x", rdCmd.deviceStatus.status);
-    qInfo(FringLog) << QString::asprintf("  Hardware Errors       : 0x%08x", rdCmd.deviceStatus.hardwareErrors);
-    qInfo(FringLog) << QString::asprintf("  Ambient Light         : %d", rdCmd.deviceStatus.ambientLightValue);
-    qInfo(FringLog) << QString::asprintf("  Temperature 0         : %d degree celsius", rdCmd.deviceStatus.temp0);
-    qInfo(FringLog) << QString::asprintf("  Temperature 1         : %d degree celsius", rdCmd.deviceStatus.temp1);
-    qInfo(FringLog) << QString::asprintf("  Temperature 2         : %d degree celsius", rdCmd.deviceStatus.temp2);
-
-    return true;
+    qInfo(FringLog) << QString::asprintf("  Status                : 0x%08x", deviceStatus.status);
+    qInfo(FringLog) << QString::asprintf("  Hardware Errors       : 0x%08x", deviceStatus.hardwareErrors);
+    qInfo(FringLog) << QString::asprintf("  Ambient Light         : %d", deviceStatus.ambientLightValue);
+    qInfo(FringLog) << QString::asprintf("  Temperature 0         : %d degree celsius", deviceStatus.temp0);
+    qInfo(FringLog) << QString::asprintf("  Temperature 1         : %d degree celsius", deviceStatus.temp1);
+    qInfo(FringLog) << QString::asprintf("  Temperature 2         : %d degree celsius", deviceStatus.temp2);
 }
 
 bool Fring::readBatteryStatus()
@@ -310,27 +428,34 @@ bool Fring::readBatteryStatus()
     if (!transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.batteryStatus)))
         return false;
 
+    handleBatteryStatus(rdCmd.batteryStatus);
+
+    return true;
+}
+
+void Fring::handleBatteryStatus(const FringProtocol::BatteryStatus &batteryStatus)
+{
     qInfo(FringLog) << "Battery status upate:";
-    qInfo(FringLog) << QString::asprintf("  Charge current        : %.2f A", rdCmd.batteryStatus.chargeCurrent * 0.05f);
-    qInfo(FringLog) << QString::asprintf("  Level                 : %d%%", rdCmd.batteryStatus.level);
-    qInfo(FringLog) << QString::asprintf("  Temperature           : %d degree celcius", rdCmd.batteryStatus.temp);
-    qInfo(FringLog) << QString::asprintf("  Remaining capacity    : %d mAh", rdCmd.batteryStatus.remainingCapacity);
-    qInfo(FringLog) << QString::asprintf("  Cycle Count           : %d", rdCmd.batteryStatus.cycleCount);
-    qInfo(FringLog) << QString::asprintf("  Average time to full  : %d min", rdCmd.batteryStatus.averageTimeToFull);
-    qInfo(FringLog) << QString::asprintf("              to empty  : %d min", rdCmd.batteryStatus.averageTimeToEmpty);
-    qInfo(FringLog) << QString::asprintf("  Status                : 0x%04x", rdCmd.batteryStatus.status);
-
-    if (batteryLevel != rdCmd.batteryStatus.level ||
-            batteryChargeCurrent != rdCmd.batteryStatus.chargeCurrent ||
-            batteryTemperature != rdCmd.batteryStatus.temp ||
-            batteryTimeToEmpty != rdCmd.batteryStatus.averageTimeToEmpty ||
-            batteryTimeToFull != rdCmd.batteryStatus.averageTimeToFull) {
-
-        batteryLevel = rdCmd.batteryStatus.level;
-        batteryChargeCurrent = rdCmd.batteryStatus.chargeCurrent;
-        batteryTemperature = rdCmd.batteryStatus.temp;
-        batteryTimeToEmpty = rdCmd.batteryStatus.averageTimeToEmpty;
-        batteryTimeToFull = rdCmd.batteryStatus.averageTimeToFull;
+    qInfo(FringLog) << QString::asprintf("  Charge current        : %.2f A", batteryStatus.chargeCurrent * 0.05f);
+    qInfo(FringLog) << QString::asprintf("  Level                 : %d%%", batteryStatus.level);
+    qInfo(FringLog) << QString::asprintf("  Temperature           : %d degree celcius", batteryStatus.temp);
+    qInfo(FringLog) << QString::asprintf("  Remaining capacity    : %d mAh", batteryStatus.remainingCapacity);
+    qInfo(FringLog) << QString::asprintf("  Cycle Count           : %d", batteryStatus.cycleCount);
+    qInfo(FringLog) << QString::asprintf("  Average time to full  : %d min", batteryStatus.averageTimeToFull);
+    qInfo(FringLog) << QString::asprintf("              to empty  : %d min", batteryStatus.averageTimeToEmpty);
+    qInfo(FringLog) << QString::asprintf("  Status                : 0x%04x", batteryStatus.status);
+
+    if (batteryLevel != batteryStatus.level ||
+            batteryChargeCurrent != batteryStatus.chargeCurrent ||
+            batteryTemperature != batteryStatus.temp ||
+            batteryTimeToEmpty != batteryStatus.averageTimeToEmpty ||
+            batteryTimeToFull != batteryStatus.averageTimeToFull) {
+
+        batteryLevel = batteryStatus.level;
+        batteryChargeCurrent = batteryStatus.chargeCurrent;
+        batteryTemperature = batteryStatus.temp;
+        batteryTimeToEmpty = batteryStatus.averageTimeToEmpty;
+        batteryTimeToFull = batteryStatus.averageTimeToFull;
 
         emit batteryStateChanged((double) batteryLevel / 100.f,
                                  (double) batteryChargeCurrent * 0.05f,
@@ -351,13 +476,13 @@ bool Fring::readBatteryStatus()
 
             QStringList l;
             l << QString::number(time->elapsed());
-            l << QString::number((double) rdCmd.batteryStatus.chargeCurrent * 0.05f);
-            l << QString::number(rdCmd.batteryStatus.level);
-            l << QString::number(rdCmd.batteryStatus.temp);
-            l << QString::number(rdCmd.batteryStatus.remainingCapacity);
-            l << QString::number(rdCmd.batteryStatus.averageTimeToFull);
-            l << QString::number(rdCmd.batteryStatus.averageTimeToEmpty);
-            l << QString::number(rdCmd.batteryStatus.status, 16);
+            l << QString::number((double) batteryStatus.chargeCurrent * 0.05f);
+            l << QString::number(batteryStatus.level);
+            l << QString::number(batteryStatus.temp);
+            l << QString::number(batteryStatus.remainingCapacity);
+            l << QString::number(batteryStatus.averageTimeToFull);
+            l << QString::number(batteryStatus.averageTimeToEmpty);
+            l << QString::number(batteryStatus.status, 16);
 
             QTextStream stream(&f);
             stream << l.join(";") << endl;
@@ -366,8 +491,6 @@ bool Fring::readBatteryStatus()
             qWarning(FringLog) << "Unable to write" << batteryLogFileName;
         }
     }
-
-    return true;
 }
 
 bool Fring::readLogMessage()
@@ -387,7 +510,7 @@ bool Fring::readLogMessage()
     return true;
 }
 
-bool Fring::readWakeupReason()
+bool Fring::readWakeupReason(bool ignoreNone)
 {
     FringProtocol::CommandRead rdCmd = {};
     FringProtocol::CommandWrite wrCmd = {};
@@ -398,24 +521,60 @@ bool Fring::readWakeupReason()
         return false;
     }
 
-    emit wakeupReasonChanged(static_cast<WakeupReason>(rdCmd.wakeupReason.reason));
+    if (ignoreNone && qFromLittleEndian(rdCmd.wakeupReason.reason) == (uint32_t) WAKEUP_REASON_NONE)
+        return true;
+
+    handleWakeupReason(rdCmd.wakeupReason);
 
     return true;
 }
 
+void Fring::handleWakeupReason(const FringProtocol::WakeupReason &wakeupReason)
+{
+    emit wakeupReasonChanged(static_cast<WakeupReason>(qFromLittleEndian(wakeupReason.reason)));
+}
+
 
 void Fring::onInterrupt(GPIO::Value v)
 {
     Q_UNUSED(v);
 
-    FringProtocol::CommandRead rdCmd = {};
-    FringProtocol::CommandWrite wrCmd = {};
+    uint32_t status;
 
-    wrCmd.reg = FringProtocol::FRING_REG_READ_INTERRUPT_STATUS;
-    if (!transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.interruptStatus)))
-        return;
+    if (protocolVersion >= FringProtocol::FRING_PROTOCOL_VERSION_3) {
+        FringProtocol::Status burst;
+
+        if (readStatus(&burst)) {
+            status = qFromLittleEndian(burst.interruptStatus.status);
 
-    uint32_t status = qFromLittleEndian(rdCmd.interruptStatus.status);
+            if (status & FringProtocol::FRING_INTERRUPT_DEVICE_STATUS)
+                handleDeviceStatus(burst.deviceStatus);
+
+            if (status & FringProtocol::FRING_INTERRUPT_WAKEUP)
+                handleWakeupReason(burst.wakeupReason);
+
+            status &= ~(FringProtocol::FRING_INTERRUPT_DEVICE_STATUS | FringProtocol::FRING_INTERRUPT_WAKEUP);
+        } else {
+            // Without a valid burst, the firmware may or may not have cleared
+            // the device status and wakeup bits already. Whatever is still
+            // pending is read the way older firmware reports it. Device and
+            // battery status are safe to read again, firmware update acks
+            // are cumulative, and a wakeup reason is only reported if the
+            // firmware has one.
+            if (!readInterruptStatus(&status))
+                status = 0;
+
+            status |= FringProtocol::FRING_INTERRUPT_DEVICE_STATUS | FringProtocol::FRING_INTERRUPT_BATTERY_STATUS;
+
+            if (updateThread && updateThread->isRunning())
+                status |= FringProtocol::FRING_INTERRUPT_FIRMWARE_UPDATE;
+
+            if (!(status & FringProtocol::FRING_INTERRUPT_WAKEUP))
+                readWakeupReason(true);
+        }
+    } else if (!readInterruptStatus(&status)) {
+        return;
+    }
 
     if (status & FringProtocol::FRING_INTERRUPT_DEVICE_STATUS)
         readDeviceStatus();
@@ -437,6 +596,33 @@ void Fring::onInterrupt(GPIO::Value v)
         readWakeupReason();
     }
 
+    reportInterruptLatency();
+}
+
+void Fring::reportInterruptLatency()
+{
+    qint64 edge = interruptGpio.lastEdgeTimestamp();
+
+    if (edge == 0)
+        return;
+
+    // From the edge, as timestamped by the kernel, to the interrupt being
+    // serviced
+    qint64 latency = GPIO::monotonicTime() - edge;
+
+    interruptLatencySum += latency;
+    interruptLatencyMax = qMax(interruptLatencyMax, latency);
+
+    if (++interruptLatencyCount < Fring::latencyReportInterval)
+        return;
+
+    qInfo(FringLog) << "Interrupt latency over" << interruptLatencyCount << "interrupts: average"
+                    << interruptLatencySum / interruptLatencyCount / 1000 << "us, maximum"
+                    << interruptLatencyMax / 1000 << "us";
+
+    interruptLatencySum = 0;
+    interruptLatencyMax = 0;
+    interruptLatencyCount = 0;
 }
 
 void Fring::startFirmwareUpdate(const QString filename)
@@ -453,7 +639,7 @@ void Fring::startFirmwareUpdate(const QString filename)
         qInfo(FringLog) << "Update thread succeeded.";
         qInfo(FringLog) << "Waiting for Fring to reappear...";
 
-        QTimer::singleShot(10000, [this]() {
+        QTimer::singleShot(10000, this, [this]() {
             if (initialize())
                 qInfo(FringLog) << "Successfully restarted fring.";
             else
@@ -477,17 +663,81 @@ void Fring::startFirmwareUpdate(const QString filename)
 
 void Fring::setWakeupMs(uint32_t ms)
 {
-    FringProtocol::CommandRead rdCmd = {};
     FringProtocol::CommandWrite wrCmd = {};
 
     wrCmd.reg = FringProtocol::FRING_REG_SET_WAKEUP_TIME;
-    wrCmd.wakeupTime.miliseconds = ms;
+    wrCmd.wakeupTime.miliseconds = qToLittleEndian(ms);
+
+    queueCommand(&wrCmd, offsetof(FringProtocol::CommandWrite, wakeupTime) + sizeof(wrCmd.wakeupTime.miliseconds));
+}
+
+bool FringCommandQueue::push(const FringProtocol::CommandWrite &wrCmd, size_t wrSize)
+{
+    quint32 t = tail.load();
+
+    if (t - head.loadAcquire() == capacity)
+        return false;
+
+    entries[t % capacity].wrCmd = wrCmd;
+    entries[t % capacity].wrSize = wrSize;
+    tail.storeRelease(t + 1);
+
+    return true;
+}
+
+bool FringCommandQueue::pop(FringProtocol::CommandWrite *wrCmd, size_t *wrSize)
+{
+    quint32 h = head.load();
+
+    if (h == tail.loadAcquire())
+        return false;
+
+    *wrCmd = entries[h % capacity].wrCmd;
+    *wrSize = entries[h % capacity].wrSize;
+    head.storeRelease(h + 1);
+
+    return true;
+}
+
+bool Fring::queueCommand(const FringProtocol::CommandWrite *wrCmd, size_t wrSize)
+{
+    if (!commands.push(*wrCmd, wrSize)) {
+        qWarning(FringLog) << "Command queue full, dropping command" << wrCmd->reg;
+        return false;
+    }
+
+    // A scheduled run drains everything queued before it starts
+    if (processScheduled.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "processCommands", Qt::QueuedConnection);
+
+    return true;
+}
+
+void Fring::processCommands()
+{
+    FringProtocol::CommandWrite wrCmd;
+    size_t wrSize;
+
+    processScheduled.storeRelease(0);
+
+    // Commands queued before initialize() are sent once the bus is open
+    if (!client.isOpen())
+        return;
+
+    while (commands.pop(&wrCmd, &wrSize))
+        transfer(&wrCmd, wrSize);
+}
 
-    transfer(&wrCmd, offsetof(FringProtocol::CommandWrite, wakeupTime) + sizeof(wrCmd.wakeupTime.miliseconds), &rdCmd, 1);
+void Fring::flushCommands()
+{
+    if (QThread::currentThread() == thread())
+        processCommands();
+    else
+        QMetaObject::invokeMethod(this, "processCommands", Qt::BlockingQueuedConnection);
 }
 
 FringUpdateThread::FringUpdateThread(Fring *fring, const QString &filename) :
-    lastEmittedProgress(0), fring(fring), file(filename), semaphore()
+    interruptStatus(0), ackedChunks(0), lastEmittedProgress(0), fring(fring), file(filename), semaphore()
 {
 }
 
@@ -510,35 +760,24 @@ void FringUpdateThread::emitProgress(double v)
     lastEmittedProgress = v;
 }
 
-uint32_t FringUpdateThread::calculateCRC(uint32_t crc, const char *buf, size_t len)
-{
-    // STM32 implements CRC32-MPEG2 which uses big endian and no final flip mask
-
-    while (len > 0) {
-        crc = (crc << 8) ^ crc32table[((crc >> 24) ^ buf[3]) & 0xff];
-        crc = (crc << 8) ^ crc32table[((crc >> 24) ^ buf[2]) & 0xff];
-        crc = (crc << 8) ^ crc32table[((crc >> 24) ^ buf[1]) & 0xff];
-        crc = (crc << 8) ^ crc32table[((crc >> 24) ^ buf[0]) & 0xff];
-
-        buf += 4;
-        len -= 4;
-    }
-
-    return crc;
-}
-
 void FringUpdateThread::run()
 {
-    uint32_t crc = ~0U;
+    uint32_t crc = Crc32Mpeg2::initialValue;
     uint32_t offset = 0;
+    uint32_t sentChunks = 0;
+    uint32_t doneChunks = 0;
+    bool lastSent = false;
     qint64 r;
-    static const size_t maxChunkSize = 32;
+    const size_t chunkSize = fring->updateChunkSize;
+    const uint32_t window = fring->updateWindow;
+    const bool windowed = fring->protocolVersion >= FringProtocol::FRING_PROTOCOL_VERSION_2;
+    QQueue<uint32_t> pendingOffsets;
     FringProtocol::CommandWrite *wrCmd;
 
-    size_t wrSize =
+    size_t headerSize =
             offsetof(FringProtocol::CommandWrite, firmwareUpdate)
-            + sizeof(wrCmd->firmwareUpdate)
-            + maxChunkSize;
+            + sizeof(wrCmd->firmwareUpdate);
+    size_t wrSize = headerSize + chunkSize;
     wrCmd = (FringProtocol::CommandWrite *) alloca(wrSize);
 
     if (!file.open(QFile::ReadOnly)) {
@@ -549,46 +788,82 @@ void FringUpdateThread::run()
 
     wrCmd->reg = FringProtocol::FRING_REG_PUSH_FIRMWARE_UPDATE;
 
-    qInfo(FringLog) << "Transmitting firmware file" << file.fileName() << "size" << file.size();
+    qInfo(FringLog) << "Transmitting firmware file" << file.fileName() << "size" << file.size()
+                    << "in chunks of" << chunkSize << "bytes, window" << window;
+
+    // An empty chunk terminates the transfer
+    while (!lastSent || doneChunks < sentChunks) {
+        // Keep the window of outstanding chunks full. Version 1 firmware
+        // takes one chunk at a time.
+        while (!lastSent && sentChunks - doneChunks < window) {
+            r = file.read(wrCmd->firmwareUpdate.payload, chunkSize);
+            if (r < 0) {
+                qWarning(FringLog) << "Unable to read firmware file!";
+                emit failed();
+                return;
+            }
 
-    do {
-        r = file.read(wrCmd->firmwareUpdate.payload, maxChunkSize);
-        if (r < 0) {
-            qWarning(FringLog) << "Unable to read firmware file!";
-            break;
-        }
+            // Align chunk size to 4 bytes
+            r += 3;
+            r &= ~3;
+
+            crc = Crc32Mpeg2::update(crc, wrCmd->firmwareUpdate.payload, r);
+            wrCmd->firmwareUpdate.crc = qToLittleEndian(crc);
+            wrCmd->firmwareUpdate.length = qToLittleEndian(r);
+            wrCmd->firmwareUpdate.offset = qToLittleEndian(offset);
+
+            // Version 1 firmware expects every transfer to have the full size
+            if (!fring->transfer(wrCmd, windowed ? headerSize + r : wrSize)) {
+                emit failed();
+                return;
+            }
 
-        // Align chunk size to 4 bytes
-        r += 3;
-        r &= ~3;
+            offset += r;
+            pendingOffsets.enqueue(offset);
+            sentChunks++;
+            lastSent = r == 0;
+        }
 
-        crc = calculateCRC(crc, wrCmd->firmwareUpdate.payload, r);
-        wrCmd->firmwareUpdate.crc = qToLittleEndian(crc);
-        wrCmd->firmwareUpdate.length = qToLittleEndian(r);
-        wrCmd->firmwareUpdate.offset = qToLittleEndian(offset);
+        // Wait for interrupt. Version 1 firmware acks whenever its flash is
+        // done, erases included, so it is waited for without a deadline as
+        // before. Negotiated firmware is bounded by ackTimeoutMs.
+        bool acked = true;
 
-        //        QString str;
-        //        str.sprintf("Transmitting %lld bytes, offset %d, crc %08x", r, offset, crc);
-        //        qInfo(FringLog) << str;
+        if (windowed)
+            acked = semaphore.tryAcquire(1, FringUpdateThread::ackTimeoutMs);
+        else
+            semaphore.acquire();
 
-        if (!fring->transfer(wrCmd, wrSize)) {
+        if (!acked) {
+            qWarning(FringLog) << "Firmware did not acknowledge update chunks in time";
             emit failed();
             return;
         }
 
-        offset += r;
-
-        // Wait for interrupt
-        semaphore.acquire();
-
         if (interruptStatus != FringProtocol::FRING_UPDATE_RESULT_OK) {
             qWarning(FringLog) << "Firmware returned bad code in response to update command:" << interruptStatus;
             emit failed();
             return;
         }
 
-        emitProgress((double) offset / (double) file.size());
-    } while(r > 0);
+        // Version 2 acknowledges chunks cumulatively, version 1 with one
+        // interrupt per chunk.
+        uint32_t done = windowed ? ackedChunks : doneChunks + 1;
+
+        if (done > sentChunks) {
+            qWarning(FringLog) << "Firmware acknowledged" << done << "of" << sentChunks << "chunks";
+            emit failed();
+            return;
+        }
+
+        uint32_t acknowledged = 0;
+
+        for (; doneChunks < done; doneChunks++)
+            acknowledged = pendingOffsets.dequeue();
+
+        if (acknowledged > 0)
+            emitProgress((double) acknowledged / (double) file.size());
+    }
 
     emit succeeded();
 }
@@ -599,9 +874,19 @@ void FringUpdateThread::interrupt()
     FringProtocol::CommandWrite wrCmd = {};
 
     wrCmd.reg = FringProtocol::FRING_REG_READ_FIRMWARE_UPDATE_RESULT;
-    if (!fring->transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.updateStatus)))
-        return;
 
-    interruptStatus = qFromLittleEndian(rdCmd.updateStatus.status);
+    if (fring->protocolVersion >= FringProtocol::FRING_PROTOCOL_VERSION_2) {
+        if (!fring->transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.updateAck)))
+            return;
+
+        interruptStatus = qFromLittleEndian(rdCmd.updateAck.status);
+        ackedChunks = qFromLittleEndian(rdCmd.updateAck.chunks);
+    } else {
+        if (!fring->transfer(&wrCmd, 1, &rdCmd, sizeof(rdCmd.updateStatus)))
+            return;
+
+        interruptStatus = qFromLittleEndian(rdCmd.updateStatus.status);
+    }
+
     semaphore.release();
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <QObject>
+#include <QAtomicInt>
+#include <QMutex>
 #include <QSemaphore>
 #include <QThread>
 #include "i2cclient.h"
@@ -13,24 +15,62 @@ struct FringCommandRead;
 struct FringCommandWrite;
 class FringUpdateThread;
 
+//
+// Ring of commands on their way to the Fring thread. There is exactly one
+// producer, the thread Daemon runs in, and one consumer, the thread Fring
+// lives in, so neither side ever takes a lock or blocks.
+//
+
+class FringCommandQueue
+{
+public:
+    FringCommandQueue() : head(0), tail(0) {}
+
+    bool push(const FringProtocol::CommandWrite &wrCmd, size_t wrSize);
+    bool pop(FringProtocol::CommandWrite *wrCmd, size_t *wrSize);
+
+private:
+    static const quint32 capacity = 16;
+
+    struct Entry {
+        FringProtocol::CommandWrite wrCmd;
+        size_t wrSize;
+    };
+
+    Entry entries[capacity];
+    QAtomicInteger<quint32> head;
+    QAtomicInteger<quint32> tail;
+};
+
+//
+// Fring is meant to be moved to a thread of its own, so that interrupts are
+// serviced without waiting for the main event loop. Its signals are then
+// delivered queued to their receivers. LED and wakeup commands only queue
+// the command and return right away; flushCommands() waits until every
+// queued command has been transferred.
+//
+
 class Fring : public QObject
 {
     Q_OBJECT
 public:
     explicit Fring(QObject *parent = 0);
-    bool initialize();
-    const QString &getDeviceSerial();
+    Q_INVOKABLE bool initialize();
+    void flushCommands();
 
-    int getFirmwareVersion() const { return firmwareVersion; }
-    uint32_t getHardwareErrors() const { return hardwareErrors; }
-    int getBoardRevisionA() const { return boardRevisionA; }
-    int getBoardRevisionB() const { return boardRevisionB; }
+    // Safe to call from any thread
+    int getFirmwareVersion() const { return firmwareVersion.loadAcquire(); }
+    uint32_t getHardwareErrors() const { return hardwareErrors.loadAcquire(); }
+    QString getDeviceSerial() const;
+    int getBoardRevisionA() const;
+    int getBoardRevisionB() const;
 
     enum WakeupReason {
         WAKEUP_REASON_NONE = 1,
         WAKEUP_REASON_HOMEBUTTON,
         WAKEUP_REASON_RTC
     };
+    Q_ENUM(WakeupReason)
 
 signals:
     void homeButtonChanged(bool state);
@@ -51,22 +91,35 @@ public slots:
 
 private slots:
     bool setLed(const FringProtocol::CommandWrite *wrCmd);
+    void processCommands();
+
+protected slots:
     void onInterrupt(GPIO::Value v);
 
 private:
     static const int GPIONr;
     static const int I2CAddr;
     static const int I2CBus;
+    static const int hostProtocolVersion;
+    static const int maxUpdateChunkSize;
+    static const int maxUpdateWindow;
 
     I2CClient client;
     GPIO interruptGpio;
 
-    int firmwareVersion;
+    QAtomicInt firmwareVersion;
+    // Written by initialize(), also after a firmware update
+    mutable QMutex infoMutex;
     int boardRevisionA;
     int boardRevisionB;
     QString deviceSerial;
     bool firmwareUpdatesEnabled;
 
+    // Negotiated with the firmware through FRING_REG_ID
+    int protocolVersion;
+    int updateChunkSize;
+    int updateWindow;
+
     int homeButtonState;
     int batteryPresent;
     int batteryLevel;
@@ -76,13 +129,18 @@ private:
     int batteryTimeToFull;
 
     int ambientLightValue;
-    uint32_t hardwareErrors;
+    QAtomicInteger<quint32> hardwareErrors;
 
+    bool negotiateProtocol();
+    bool readStatus(FringProtocol::Status *status);
+    bool readInterruptStatus(uint32_t *status);
     bool readDeviceStatus();
     bool readBatteryStatus();
     bool readLogMessage();
-    bool readWakeupReason();
-    uint32_t calculateCRC(uint32_t crc, const char *buf, size_t len);
+    bool readWakeupReason(bool ignoreNone = false);
+    void handleDeviceStatus(const FringProtocol::DeviceStatus &deviceStatus);
+    void handleBatteryStatus(const FringProtocol::BatteryStatus &batteryStatus);
+    void handleWakeupReason(const FringProtocol::WakeupReason &wakeupReason);
 
     FringUpdateThread *updateThread;
 
@@ -91,9 +149,22 @@ private:
     FringProtocol::CommandWrite ledCache[2];
     bool ledCacheValid;
 
+    FringCommandQueue commands;
+    QAtomicInt processScheduled;
+
+    bool queueCommand(const FringProtocol::CommandWrite *wrCmd, size_t wrSize);
+
+    static const int latencyReportInterval = 64;
+    qint64 interruptLatencySum;
+    qint64 interruptLatencyMax;
+    int interruptLatencyCount;
+
+    void reportInterruptLatency();
+
 protected:
     friend class FringUpdateThread;
-    bool transfer(const FringProtocol::CommandWrite *wrCmd, size_t wrSize, const FringProtocol::CommandRead *rdCmd = 0, size_t rdSize = 0);
+    friend class FringBenchmark;
+    virtual bool transfer(const FringProtocol::CommandWrite *wrCmd, size_t wrSize, const FringProtocol::CommandRead *rdCmd = 0, size_t rdSize = 0);
 };
 
 class FringUpdateThread : public QThread
@@ -114,12 +185,15 @@ signals:
     void failed();
 
 private:
+    // Only applies to firmware that negotiated protocol version 2 or later
+    static const int ackTimeoutMs = 5000;
+
     int interruptStatus;
+    uint32_t ackedChunks;
     double lastEmittedProgress;
     Fring *fring;
     QFile file;
     QSemaphore semaphore;
-    uint32_t calculateCRC(uint32_t crc, const char *buf, size_t len);
 
     void emitProgress(double v);
 };
@@ -1,31 +1,69 @@
 #include "gpio.h"
 
+#include <QDir>
 #include <QFile>
+#include <QFileInfo>
 #include <QSocketNotifier>
-#include <QFile>
+
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/gpio.h>
 
 Q_LOGGING_CATEGORY(GPIOLog, "GPIO")
 
 const QString GPIO::basePath = "/sys/class/gpio";
+const QString GPIO::chipPath = "/dev/gpiochip0";
+const QString GPIO::chipDevicePath = "/sys/bus/gpio/devices/gpiochip0";
 
 GPIO::GPIO(int number, QObject *parent) :
     QObject(parent),
     gpioPath(GPIO::basePath + "/gpio" + QString::number(number)),
     number(number),
     pathExport(GPIO::basePath + "/export"),
-    pathUnexport(GPIO::basePath + "/unexport")
+    pathUnexport(GPIO::basePath + "/unexport"),
+    direction(GPIO::DirectionIn),
+    configured(false),
+    edge(GPIO::EdgeBoth),
+    hasEdge(false),
+    backend(GPIO::BackendSysfs),
+    chipFd(-1),
+    lineFd(-1),
+    edgeFlags(0),
+    lineNotifier(NULL),
+    edgeTimestamp(0)
 {
-    QFile f(pathExport);
-    if (!f.exists() || !f.open(QFile::WriteOnly)) {
-        qWarning(GPIOLog) << "Can not open file: " << pathExport;
-        return;
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    if (qgetenv("KALAMI_GPIO_SYSFS") != "1") {
+        // The line itself is only requested once it is configured
+        chipFd = ::open(GPIO::chipPath.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
+        if (chipFd >= 0) {
+            backend = GPIO::BackendChardev;
+            return;
+        }
+
+        qInfo(GPIOLog) << "Can not open" << GPIO::chipPath << "using sysfs for gpio" << number;
     }
-    f.write(QString::number(number).toLocal8Bit());
-    f.flush();
+#endif
+
+    exportLine();
 }
 
 GPIO::~GPIO()
 {
+    if (backend == GPIO::BackendChardev) {
+        delete lineNotifier;
+
+        if (lineFd >= 0)
+            ::close(lineFd);
+
+        ::close(chipFd);
+        return;
+    }
+
     closeValueFile();
 
     QFile f(pathUnexport);
@@ -37,9 +75,128 @@ GPIO::~GPIO()
     f.flush();
 }
 
+qint64 GPIO::monotonicTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (qint64) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void GPIO::exportLine()
+{
+    QFile f(pathExport);
+    if (!f.exists() || !f.open(QFile::WriteOnly)) {
+        qWarning(GPIOLog) << "Can not open file: " << pathExport;
+        return;
+    }
+    f.write(QString::number(number).toLocal8Bit());
+    f.flush();
+}
+
+void GPIO::useSysfs()
+{
+    delete lineNotifier;
+    lineNotifier = NULL;
+
+    if (lineFd >= 0) {
+        ::close(lineFd);
+        lineFd = -1;
+    }
+
+    if (chipFd >= 0) {
+        ::close(chipFd);
+        chipFd = -1;
+    }
+
+    backend = GPIO::BackendSysfs;
+    exportLine();
+
+    // Apply what was configured on the line request so far
+    if (hasEdge)
+        setEdge(edge);
+
+    if (configured)
+        setDirection(direction);
+}
+
+bool GPIO::configureLine()
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.flags = direction == GPIO::DirectionOut ?
+                GPIO_V2_LINE_FLAG_OUTPUT : GPIO_V2_LINE_FLAG_INPUT | edgeFlags;
+
+    if (lineFd >= 0) {
+        if (ioctl(lineFd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+            qWarning(GPIOLog) << "Can not configure gpio" << number << ":" << strerror(errno);
+            return false;
+        }
+
+        return true;
+    }
+
+    struct gpio_v2_line_request request;
+
+    memset(&request, 0, sizeof(request));
+    request.offsets[0] = number;
+    request.num_lines = 1;
+    request.config = config;
+    request.event_buffer_size = GPIO::eventBatchSize * 4;
+    strncpy(request.consumer, "kalami", sizeof(request.consumer) - 1);
+
+    // Kernels before 5.10 don't know the v2 uAPI (ENOTTY), and the line may
+    // be held by someone else (EBUSY). sysfs gets a go in either case.
+    if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+        qInfo(GPIOLog) << "Can not request gpio" << number << "from" << GPIO::chipPath << ":" << strerror(errno)
+                       << "using sysfs";
+        useSysfs();
+        return false;
+    }
+
+    lineFd = request.fd;
+    lineNotifier = new QSocketNotifier(lineFd, QSocketNotifier::Read, this);
+    QObject::connect(lineNotifier, &QSocketNotifier::activated, this, &GPIO::readEvents);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void GPIO::readEvents()
+{
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_event events[GPIO::eventBatchSize];
+
+    ssize_t r = ::read(lineFd, events, sizeof(events));
+    if (r < (ssize_t) sizeof(events[0])) {
+        if (r < 0 && errno != EAGAIN)
+            qWarning(GPIOLog) << "Can not read events of gpio" << number << ":" << strerror(errno);
+
+        return;
+    }
+
+    int n = r / sizeof(events[0]);
+
+    edgeTimestamp = events[0].timestamp_ns;
+    emit onDataReady(events[n - 1].id == GPIO_V2_LINE_EVENT_RISING_EDGE ? ValueHi : ValueLo);
+#endif
+}
+
 void GPIO::setDirection(Direction io)
 {
     direction = io;
+    configured = true;
+
+    if (backend == GPIO::BackendChardev) {
+        configureLine();
+        return;
+    }
+
     QFile f(gpioPath + "/direction");
     if (!f.exists() || !f.open(QFile::WriteOnly)) {
         qWarning(GPIOLog) << "Can not open file: " << gpioPath << "/direction";
@@ -55,6 +212,7 @@ void GPIO::setDirection(Direction io)
         auto sn = new QSocketNotifier(valueFile.handle(), QSocketNotifier::Exception, this);
         QObject::connect(sn, &QSocketNotifier::activated, [this](int fd) {
             Q_UNUSED(fd);
+            edgeTimestamp = GPIO::monotonicTime();
             valueFile.reset();
             auto buf = valueFile.readAll();
             if (buf.isEmpty()) {
@@ -75,6 +233,25 @@ void GPIO::setDirection(Direction io)
 
 void GPIO::set(GPIO::Value v)
 {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    if (backend == GPIO::BackendChardev) {
+        struct gpio_v2_line_values values;
+
+        if (lineFd < 0 || direction != GPIO::DirectionOut) {
+            qWarning(GPIOLog) << "Can not write to gpio, it's not an output: " << number;
+            return;
+        }
+
+        values.mask = 1;
+        values.bits = v == ValueHi ? 1 : 0;
+
+        if (ioctl(lineFd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+            qWarning(GPIOLog) << "Can not write to gpio" << number << ":" << strerror(errno);
+
+        return;
+    }
+#endif
+
     if (!valueFile.isOpen()) {
         qWarning(GPIOLog) << "Value file not opened, ignoring write: " << gpioPath << "/value";
         return;
@@ -94,6 +271,27 @@ void GPIO::setEdge(Edge e)
 {
     QString data;
 
+    edge = e;
+    hasEdge = true;
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    if (backend == GPIO::BackendChardev) {
+        edgeFlags = 0;
+
+        if (e & GPIO::EdgeRising)
+            edgeFlags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+
+        if (e & GPIO::EdgeFalling)
+            edgeFlags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+        // Edges take effect with the request for an input line
+        if (lineFd >= 0)
+            configureLine();
+
+        return;
+    }
+#endif
+
     if (e == GPIO::EdgeRising)
         data = "rising";
     else if (e == GPIO::EdgeFalling)
@@ -120,6 +318,26 @@ void GPIO::setWakeupSource(WakeupSource w)
     else if (w == GPIO::DontWakeup)
         data = "disabled";
 
+    // A line request can't make its interrupt a wakeup source. The line is
+    // kept for its events, and wakeup is enabled on the GPIO controller
+    // instead, which arms the interrupts of its requested lines on suspend.
+    // Controllers without that attribute need wakeup-source in the device
+    // tree.
+    if (backend == GPIO::BackendChardev) {
+        QString controller = QDir::cleanPath(QFileInfo(GPIO::chipDevicePath).canonicalFilePath() + "/..");
+        QFile f(controller + "/power/wakeup");
+
+        if (!f.open(QFile::WriteOnly)) {
+            qWarning(GPIOLog) << "Can not open file:" << f.fileName() << "- wakeup by gpio" << number
+                              << "is left to the device tree";
+            return;
+        }
+
+        f.write(data.toLocal8Bit());
+        f.flush();
+        return;
+    }
+
     QFile f(gpioPath + "/wakeup");
     if (!f.open(QFile::WriteOnly)) {
         qWarning(GPIOLog) << "Can not open file: " << gpioPath << "/wakeup";
@@ -6,6 +6,26 @@
 
 Q_DECLARE_LOGGING_CATEGORY(GPIOLog)
 
+class QSocketNotifier;
+
+//
+// GPIO drives a line through a line request on the GPIO character device,
+// or through the legacy sysfs interface. The kernel queues edges on a line
+// request with a timestamp, and they are read in batches; edges that queued
+// up while the previous batch was handled are reported with one signal.
+// With sysfs, only the fact that the value changed at some point is known.
+//
+// The character device takes the line number as an offset on the first GPIO
+// chip, which matches the sysfs numbering as long as that chip's base is 0.
+// sysfs is used instead when the character device can't be opened, the
+// line can't be requested from it, or the headers predate the v2 uAPI.
+// Setting KALAMI_GPIO_SYSFS=1 forces sysfs for all lines.
+//
+// A line request can't make its interrupt a wakeup source. With the
+// character device, wakeup is enabled through the power/wakeup attribute of
+// the GPIO controller, or left to wakeup-source in the device tree.
+//
+
 class GPIO : public QObject
 {
     Q_OBJECT
@@ -34,6 +54,11 @@ public:
         DontWakeup   = 1
     };
 
+    // Monotonic time in ns of the oldest edge reported by the last signal
+    qint64 lastEdgeTimestamp() const { return edgeTimestamp; }
+
+    static qint64 monotonicTime();
+
 signals:
     void onDataReady(Value v);
 
@@ -47,14 +72,36 @@ private:
     Q_DISABLE_COPY(GPIO)
     void openValueFile(QFile::OpenModeFlag f);
     void closeValueFile();
+    void exportLine();
+    void useSysfs();
+    bool configureLine();
+    void readEvents();
+
+    enum Backend {
+        BackendChardev,
+        BackendSysfs
+    };
 
     const static QString basePath;
+    const static QString chipPath;
+    const static QString chipDevicePath;
+    static const int eventBatchSize = 16;
     QString gpioPath;
 
     int number;
     QString pathExport;
     QString pathUnexport;
     Direction direction;
+    bool configured;
+    Edge edge;
+    bool hasEdge;
 
     QFile valueFile;
+
+    Backend backend;
+    int chipFd;
+    int lineFd;
+    quint64 edgeFlags;
+    QSocketNotifier *lineNotifier;
+    qint64 edgeTimestamp;
 };
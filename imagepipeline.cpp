@@ -0,0 +1,233 @@
+#include <QMutexLocker>
+
+#include "imagepipeline.h"
+
+Q_LOGGING_CATEGORY(ImagePipelineLog, "ImagePipeline")
+
+ImagePipeline::ImagePipeline(BlockDevice *output, int numSlots, qint64 slotSize, QObject *parent) :
+    QObject(parent),
+    output(output),
+    throttler(NULL),
+    ring(numSlots),
+    slotSize(slotSize),
+    produced(0),
+    written(0),
+    hashed(0),
+    fill(0),
+    finishing(false),
+    error(false),
+    mutex(),
+    cond(),
+    writer(this, &ImagePipeline::writeStage),
+    hasher(this, &ImagePipeline::hashStage),
+    hash(),
+    totalBytes(0)
+{
+    for (int i = 0; i < ring.size(); i++) {
+        ring[i].data = BlockDevice::allocateBuffer(slotSize);
+        ring[i].length = 0;
+    }
+}
+
+ImagePipeline::~ImagePipeline()
+{
+    if (writer.isRunning() || hasher.isRunning())
+        abort();
+
+    for (int i = 0; i < ring.size(); i++)
+        BlockDevice::freeBuffer(ring[i].data);
+}
+
+bool ImagePipeline::start(qint64 offset, const QByteArray &hashState)
+{
+    for (int i = 0; i < ring.size(); i++)
+        if (!ring[i].data) {
+            qWarning(ImagePipelineLog) << "Unable to allocate" << ring.size() << "buffers of" << slotSize << "bytes";
+            return false;
+        }
+
+    produced = written = hashed = 0;
+    fill = 0;
+    finishing = false;
+    error = false;
+    totalBytes = 0;
+    digest.clear();
+    hash.reset();
+
+    if (offset > 0) {
+        if (!hash.restoreState(hashState)) {
+            qWarning(ImagePipelineLog) << "Invalid hash state, cannot resume at offset" << offset;
+            return false;
+        }
+
+        if (!output->seek(offset)) {
+            qWarning(ImagePipelineLog) << "Unable to seek" << output->fileName() << "to offset" << offset;
+            return false;
+        }
+
+        totalBytes = offset;
+    }
+
+    writer.start();
+    hasher.start();
+
+    return true;
+}
+
+bool ImagePipeline::commitSlot()
+{
+    QMutexLocker locker(&mutex);
+
+    ring[produced % ring.size()].length = fill;
+    produced++;
+    fill = 0;
+    cond.wakeAll();
+
+    return !error;
+}
+
+bool ImagePipeline::push(const char *data, qint64 length)
+{
+    while (length > 0) {
+        if (fill == 0) {
+            // Wait for the slot we're about to fill to be released by both consumers
+            QMutexLocker locker(&mutex);
+
+            while (!error && produced - qMin(written, hashed) >= (quint64) ring.size())
+                cond.wait(&mutex);
+
+            if (error)
+                return false;
+        }
+
+        Slot &slot = ring[produced % ring.size()];
+        qint64 l = qMin(slotSize - fill, length);
+
+        memcpy(slot.data + fill, data, l);
+        fill += l;
+        data += l;
+        length -= l;
+        totalBytes += l;
+
+        if (fill == slotSize && !commitSlot())
+            return false;
+    }
+
+    return true;
+}
+
+bool ImagePipeline::checkpoint(qint64 *offset, QByteArray *hashState)
+{
+    if (fill > 0 && !commitSlot())
+        return false;
+
+    mutex.lock();
+
+    while (!error && (written != produced || hashed != produced))
+        cond.wait(&mutex);
+
+    mutex.unlock();
+
+    // Both stages are idle now, and only we can produce new slots
+    if (error || !output->sync())
+        return false;
+
+    *offset = totalBytes;
+    *hashState = hash.saveState();
+
+    return true;
+}
+
+bool ImagePipeline::finish()
+{
+    if (fill > 0)
+        commitSlot();
+
+    mutex.lock();
+    finishing = true;
+    cond.wakeAll();
+    mutex.unlock();
+
+    writer.wait();
+    hasher.wait();
+
+    if (error || !output->sync()) {
+        qWarning(ImagePipelineLog) << "Pipeline for" << output->fileName() << "failed";
+        return false;
+    }
+
+    digest = hash.result();
+
+    return true;
+}
+
+void ImagePipeline::abort()
+{
+    mutex.lock();
+    error = true;
+    cond.wakeAll();
+    mutex.unlock();
+
+    writer.wait();
+    hasher.wait();
+}
+
+void ImagePipeline::writeStage()
+{
+    forever {
+        mutex.lock();
+
+        while (!error && !finishing && written == produced)
+            cond.wait(&mutex);
+
+        if (error || written == produced) {
+            mutex.unlock();
+            return;
+        }
+
+        const Slot &slot = ring[written % ring.size()];
+        mutex.unlock();
+
+        qint64 r = output->write(slot.data, slot.length);
+
+        if (throttler)
+            throttler->throttle(r);
+
+        mutex.lock();
+
+        if (r != slot.length) {
+            qWarning(ImagePipelineLog) << "Short write to" << output->fileName() << ":" << r << "!=" << slot.length;
+            error = true;
+        } else {
+            written++;
+        }
+
+        cond.wakeAll();
+        mutex.unlock();
+    }
+}
+
+void ImagePipeline::hashStage()
+{
+    forever {
+        mutex.lock();
+
+        while (!error && !finishing && hashed == produced)
+            cond.wait(&mutex);
+
+        if (error || hashed == produced) {
+            mutex.unlock();
+            return;
+        }
+
+        const Slot &slot = ring[hashed % ring.size()];
+        mutex.unlock();
+
+        hash.addData(slot.data, slot.length);
+
+        mutex.lock();
+        hashed++;
+        cond.wakeAll();
+        mutex.unlock();
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+#include <QtCore/QLoggingCategory>
+
+#include "blockdevice.h"
+#include "sha512.h"
+#include "iothrottler.h"
+
+Q_DECLARE_LOGGING_CATEGORY(ImagePipelineLog)
+
+//
+// ImagePipeline decouples network receive, block device writes and SHA512
+// hashing of an image. Data pushed by the producer is collected in a bounded
+// ring of reusable buffers, which are consumed by a writer and a hasher thread
+// in parallel. A buffer is recycled once both stages are done with it, and the
+// producer blocks when the ring is full.
+//
+// The pipeline can be started at an offset with a previously saved hash state
+// to continue an interrupted download, and checkpoint() drains and syncs all
+// stages to obtain a consistent state to resume from later.
+//
+
+class ImagePipeline : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ImagePipeline(BlockDevice *output, int numSlots = 8, qint64 slotSize = 1024 * 1024, QObject *parent = 0);
+    ~ImagePipeline();
+
+    void setThrottler(IoThrottler *t) { throttler = t; }
+    bool start(qint64 offset = 0, const QByteArray &hashState = QByteArray());
+    bool push(const char *data, qint64 length);
+    bool checkpoint(qint64 *offset, QByteArray *hashState);
+    bool finish();
+    void abort();
+
+    QByteArray result() const { return digest; }
+    qint64 bytesProcessed() const { return totalBytes; }
+
+private:
+    class Stage : public QThread
+    {
+    public:
+        Stage(ImagePipeline *pipeline, void (ImagePipeline::*func)()) :
+            pipeline(pipeline), func(func) {}
+
+    protected:
+        void run() Q_DECL_OVERRIDE { (pipeline->*func)(); }
+
+    private:
+        ImagePipeline *pipeline;
+        void (ImagePipeline::*func)();
+    };
+
+    // Slot buffers are page aligned, so they can be handed to a device opened
+    // for direct I/O without copying.
+    struct Slot {
+        char *data;
+        qint64 length;
+    };
+
+    BlockDevice *output;
+    IoThrottler *throttler;
+    QVector<Slot> ring;
+    qint64 slotSize;
+
+    // Monotonic slot counters, protected by mutex
+    quint64 produced;
+    quint64 written;
+    quint64 hashed;
+    qint64 fill;
+    bool finishing;
+    bool error;
+
+    QMutex mutex;
+    QWaitCondition cond;
+
+    Stage writer;
+    Stage hasher;
+    Sha512 hash;
+    QByteArray digest;
+    qint64 totalBytes;
+
+    bool commitSlot();
+    void writeStage();
+    void hashStage();
+};
@@ -61,9 +61,9 @@ static inline size_t ALIGN_TO(size_t l, size_t ali) {
     return ((l + ali - 1) & ~(ali - 1));
 }
 
-bool ImageReader::open()
+bool ImageReader::open(int flags)
 {
-    if (!BlockDevice::open(QIODevice::ReadOnly))
+    if (!BlockDevice::open(QIODevice::ReadOnly, flags))
         return false;
 
     switch (type) {
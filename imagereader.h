@@ -22,7 +22,7 @@ public:
     explicit ImageReader(enum ImageType type, const QString path, QObject *parent = 0);
 
     qint64 size() { return imageSize; };
-    bool open();
+    bool open(int flags = BlockDevice::NoFlags);
 
 private:
     enum ImageType type;
@@ -0,0 +1,201 @@
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+
+#include "iothrottler.h"
+
+Q_LOGGING_CATEGORY(IoThrottlerLog, "IoThrottler")
+
+// Fraction of wall time in which some task was stalled on I/O or CPU
+const double IoThrottler::lowPressure = 0.05;
+const double IoThrottler::highPressure = 0.40;
+
+const QString IoThrottler::cgroupRoot = "/sys/fs/cgroup";
+
+IoThrottler::IoThrottler(unsigned maxUsecPerKb) :
+    maxDelay(maxUsecPerKb),
+    currentDelay(maxUsecPerKb),
+    psiAvailable(false),
+    cgroupPath(ownCgroupPath()),
+    lastIoTotal(0),
+    lastCpuTotal(0),
+    mutex()
+{
+    StallTotals own;
+
+    if (!cgroupPath.isEmpty() && !readStallTotals(cgroupPath, &own)) {
+        qInfo(IoThrottlerLog) << "No pressure stall information for" << cgroupPath
+                              << "- using system wide pressure";
+        cgroupPath.clear();
+    }
+
+    // The first sample of every other cgroup only sets its baseline
+    if (!cgroupPath.isEmpty())
+        otherCgroupsStall();
+
+    psiAvailable = readStallTotal("/proc/pressure/io", &lastIoTotal) &&
+                   readStallTotal("/proc/pressure/cpu", &lastCpuTotal);
+
+    if (psiAvailable)
+        currentDelay = 0;
+    else
+        qInfo(IoThrottlerLog) << "No pressure stall information available, using fixed delay of"
+                              << maxDelay << "usec per KiB";
+
+    sampleTimer.start();
+}
+
+QString IoThrottler::ownCgroupPath()
+{
+    QFile f("/proc/self/cgroup");
+
+    if (!f.open(QFile::ReadOnly))
+        return QString();
+
+    // 0::/system.slice/kalami.service
+    forever {
+        QByteArray line = f.readLine().trimmed();
+        if (line.isEmpty())
+            return QString();
+
+        // The root cgroup has no PSI files of its own
+        if (line.startsWith("0::") && line.size() > 4)
+            return IoThrottler::cgroupRoot + QString::fromLocal8Bit(line.mid(3));
+    }
+}
+
+QStringList IoThrottler::otherCgroups() const
+{
+    QStringList cgroups;
+    QString path = cgroupPath;
+
+    // The siblings of our cgroup and of each of its ancestors hold every task
+    // but ours
+    while (path.length() > IoThrottler::cgroupRoot.length()) {
+        QFileInfo info(path);
+        QDir parent(info.path());
+
+        foreach (const QString &entry, parent.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+            if (entry != info.fileName())
+                cgroups << parent.filePath(entry);
+
+        path = info.path();
+    }
+
+    return cgroups;
+}
+
+bool IoThrottler::readStallTotals(const QString &cgroup, StallTotals *totals)
+{
+    return readStallTotal(cgroup + "/io.pressure", &totals->io) &&
+           readStallTotal(cgroup + "/cpu.pressure", &totals->cpu);
+}
+
+qint64 IoThrottler::otherCgroupsStall()
+{
+    QHash<QString, StallTotals> totals;
+    qint64 stall = 0;
+
+    foreach (const QString &cgroup, otherCgroups()) {
+        StallTotals t;
+
+        if (!readStallTotals(cgroup, &t))
+            continue;
+
+        // Cgroups that showed up since the last sample only get a baseline
+        QHash<QString, StallTotals>::const_iterator last = lastCgroupTotals.constFind(cgroup);
+        if (last != lastCgroupTotals.constEnd())
+            stall = qMax(stall, qMax(t.io - last->io, t.cpu - last->cpu));
+
+        totals.insert(cgroup, t);
+    }
+
+    lastCgroupTotals = totals;
+
+    return stall;
+}
+
+bool IoThrottler::readStallTotal(const QString &path, qint64 *total)
+{
+    QFile f(path);
+
+    if (!f.open(QFile::ReadOnly))
+        return false;
+
+    // some avg10=0.00 avg60=0.00 avg300=0.00 total=12345
+    QList<QByteArray> fields = f.readLine().trimmed().split(' ');
+
+    if (fields.isEmpty() || fields.first() != "some")
+        return false;
+
+    foreach (const QByteArray &field, fields)
+        if (field.startsWith("total=")) {
+            *total = field.mid(6).toLongLong();
+            return true;
+        }
+
+    return false;
+}
+
+void IoThrottler::sample()
+{
+    qint64 elapsedUs = sampleTimer.nsecsElapsed() / 1000;
+    qint64 stall;
+
+    if (!cgroupPath.isEmpty()) {
+        // The most stalled cgroup other than ours. Its "some" figure counts
+        // the time its tasks waited, whether or not the updater was waiting
+        // on the same device at the same time.
+        stall = otherCgroupsStall();
+    } else {
+        qint64 ioTotal, cpuTotal;
+
+        if (!readStallTotal("/proc/pressure/io", &ioTotal) ||
+            !readStallTotal("/proc/pressure/cpu", &cpuTotal))
+            return;
+
+        stall = qMax(ioTotal - lastIoTotal, cpuTotal - lastCpuTotal);
+        lastIoTotal = ioTotal;
+        lastCpuTotal = cpuTotal;
+    }
+
+    double pressure = (double) stall / (double) elapsedUs;
+
+    sampleTimer.restart();
+
+    double target;
+
+    if (pressure <= lowPressure)
+        target = 0.0;
+    else if (pressure >= highPressure)
+        target = maxDelay;
+    else
+        target = maxDelay * (pressure - lowPressure) / (highPressure - lowPressure);
+
+    // Back off immediately, but speed up again only gradually
+    unsigned delay = target > currentDelay ? target : (currentDelay + target) / 2;
+
+    if (delay != currentDelay)
+        qDebug(IoThrottlerLog) << "Pressure" << pressure << "- delay now" << delay << "usec per KiB";
+
+    currentDelay = delay;
+}
+
+unsigned IoThrottler::usecPerKb()
+{
+    QMutexLocker locker(&mutex);
+
+    if (psiAvailable && sampleTimer.elapsed() >= sampleIntervalMs)
+        sample();
+
+    return currentDelay;
+}
+
+void IoThrottler::throttle(qint64 bytes)
+{
+    unsigned delay = usecPerKb();
+
+    if (delay > 0)
+        QThread::usleep(delay * (bytes / 1024));
+}
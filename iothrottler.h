@@ -0,0 +1,61 @@
+#pragma once
+
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QtCore/QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(IoThrottlerLog)
+
+//
+// IoThrottler paces background I/O of the updater according to the system's
+// pressure stall information (PSI) for I/O and CPU. When nothing else competes
+// for these resources, the updater runs unthrottled. As pressure rises, the
+// delay per KiB approaches the configured maximum. Kernels without PSI get the
+// maximum delay at all times.
+//
+// The updater's own stalls would otherwise throttle it with nobody else
+// waiting. So when it runs in a cgroup (v2, as found in /proc/self/cgroup)
+// with PSI files, the pressure is that of the most stalled cgroup holding
+// other tasks: the siblings of its own cgroup and of each ancestor. Outside
+// of such a cgroup, the system wide figures are used.
+//
+
+class IoThrottler
+{
+public:
+    explicit IoThrottler(unsigned maxUsecPerKb);
+
+    unsigned usecPerKb();
+    void throttle(qint64 bytes);
+
+private:
+    static const qint64 sampleIntervalMs = 500;
+    static const double lowPressure;
+    static const double highPressure;
+    static const QString cgroupRoot;
+
+    struct StallTotals {
+        qint64 io;
+        qint64 cpu;
+    };
+
+    unsigned maxDelay;
+    unsigned currentDelay;
+    bool psiAvailable;
+    QString cgroupPath;
+    qint64 lastIoTotal;
+    qint64 lastCpuTotal;
+    QHash<QString, StallTotals> lastCgroupTotals;
+    QElapsedTimer sampleTimer;
+    QMutex mutex;
+
+    static QString ownCgroupPath();
+    QStringList otherCgroups() const;
+    bool readStallTotal(const QString &path, qint64 *total);
+    bool readStallTotals(const QString &cgroup, StallTotals *totals);
+    qint64 otherCgroupsStall();
+    void sample();
+};
@@ -0,0 +1,191 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iouring.h"
+
+IoUring::IoUring(unsigned entries) :
+    ringFd(-1),
+    sqEntries(0),
+    queued(0),
+    sqRing(MAP_FAILED),
+    sqRingSize(0),
+    cqRing(MAP_FAILED),
+    cqRingSize(0),
+    sqes((struct io_uring_sqe *) MAP_FAILED),
+    sqesSize(0),
+    iovecs(NULL)
+{
+#ifdef __NR_io_uring_setup
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return;
+
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    iovecs = (struct iovec *) calloc(p.sq_entries, sizeof(struct iovec));
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED || !iovecs) {
+        ::close(fd);
+        return;
+    }
+
+    char *sq = (char *) sqRing;
+    sqHead = (unsigned *) (sq + p.sq_off.head);
+    sqTail = (unsigned *) (sq + p.sq_off.tail);
+    sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *) (sq + p.sq_off.array);
+
+    char *cq = (char *) cqRing;
+    cqHead = (unsigned *) (cq + p.cq_off.head);
+    cqTail = (unsigned *) (cq + p.cq_off.tail);
+    cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    sqEntries = p.sq_entries;
+    ringFd = fd;
+#else
+    (void) entries;
+#endif
+}
+
+IoUring::~IoUring()
+{
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+
+    if (cqRing != MAP_FAILED)
+        munmap(cqRing, cqRingSize);
+
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+
+    free(iovecs);
+
+    if (ringFd >= 0)
+        ::close(ringFd);
+}
+
+int IoUring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+#ifdef __NR_io_uring_enter
+    int r;
+
+    do {
+        r = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+
+    return r;
+#else
+    (void) toSubmit;
+    (void) minComplete;
+    (void) flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+bool IoUring::prepare(int opcode, int fd, void *buf, size_t length, int64_t offset, uint64_t userData)
+{
+    if (!isValid())
+        return false;
+
+    unsigned tail = *sqTail;
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= sqEntries)
+        return false;
+
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+
+    // The iovec must stay valid until the kernel consumed the entry, which is
+    // guaranteed before the slot can be reused.
+    iovecs[index].iov_base = buf;
+    iovecs[index].iov_len = length;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t) (uintptr_t) &iovecs[index];
+    sqe->len = 1;
+    sqe->user_data = userData;
+
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+
+    return true;
+}
+
+bool IoUring::prepareRead(int fd, char *buf, size_t length, int64_t offset, uint64_t userData)
+{
+    return prepare(IORING_OP_READV, fd, buf, length, offset, userData);
+}
+
+bool IoUring::prepareWrite(int fd, const char *buf, size_t length, int64_t offset, uint64_t userData)
+{
+    return prepare(IORING_OP_WRITEV, fd, (void *) buf, length, offset, userData);
+}
+
+bool IoUring::submit(unsigned waitFor)
+{
+    if (!isValid())
+        return false;
+
+    if (queued == 0 && waitFor == 0)
+        return true;
+
+    int r = enter(queued, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (r < 0)
+        return false;
+
+    queued -= r;
+
+    return true;
+}
+
+bool IoUring::reap(uint64_t *userData, int *result, bool wait)
+{
+    if (!isValid())
+        return false;
+
+    for (;;) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+        if (head != tail) {
+            struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+
+            *userData = cqe->user_data;
+            *result = cqe->res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+            return true;
+        }
+
+        if (!wait)
+            return false;
+
+        int r = enter(queued, 1, IORING_ENTER_GETEVENTS);
+        if (r < 0)
+            return false;
+
+        // Submissions the kernel didn't consume stay queued
+        queued -= r;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+//
+// Minimal io_uring wrapper, talking to the kernel through the raw system calls
+// so there's no dependency on liburing. Requests are queued with prepareRead()
+// and prepareWrite(), handed to the kernel in batches with submit(), and their
+// results collected with reap(). isValid() returns false if the kernel doesn't
+// support io_uring, in which case callers must fall back to synchronous I/O.
+//
+
+class IoUring
+{
+public:
+    explicit IoUring(unsigned entries = 32);
+    ~IoUring();
+
+    bool isValid() const { return ringFd >= 0; }
+    unsigned capacity() const { return sqEntries; }
+
+    bool prepareRead(int fd, char *buf, size_t length, int64_t offset, uint64_t userData);
+    bool prepareWrite(int fd, const char *buf, size_t length, int64_t offset, uint64_t userData);
+    bool submit(unsigned waitFor = 0);
+    bool reap(uint64_t *userData, int *result, bool wait);
+
+private:
+    int ringFd;
+    unsigned sqEntries;
+    unsigned queued;
+
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct iovec *iovecs;
+
+    bool prepare(int opcode, int fd, void *buf, size_t length, int64_t offset, uint64_t userData);
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+};
@@ -30,7 +30,21 @@ SOURCES += main.cpp \
     mediactl.cpp \
     nubbock.cpp \
     kirbymessage.cpp \
-    kirbyconnection.cpp
+    kirbyconnection.cpp \
+    imagepipeline.cpp \
+    vcdiffoutput.cpp \
+    sha512.cpp \
+    crc32mpeg2.cpp \
+    downloadjournal.cpp \
+    chunkeddownloader.cpp \
+    blockupdater.cpp \
+    iothrottler.cpp \
+    iouring.cpp \
+    treeverifier.cpp \
+    signatureverifier.cpp \
+    manifestcache.cpp \
+    deltaplanner.cpp \
+    streaminflater.cpp
 
 HEADERS += \
     accelerometer.h \
@@ -48,15 +62,32 @@ HEADERS += \
     brightnesscontrol.h \
     fring-protocol.h \
     imagereader.h \
-    crc32table.h \
+    crc32mpeg2.h \
     blockdevice.h \
     mediactl.h \
     nubbock.h \
     kirbyconnection.h \
-    kirbymessage.h
+    kirbymessage.h \
+    imagepipeline.h \
+    vcdiffoutput.h \
+    sha512.h \
+    downloadjournal.h \
+    chunkeddownloader.h \
+    blockupdater.h \
+    iothrottler.h \
+    iouring.h \
+    treeverifier.h \
+    signatureverifier.h \
+    manifestcache.h \
+    deltaplanner.h \
+    streaminflater.h
 
 LIBS += -ludev
 LIBS += -lconnman-qt5
 LIBS += -lasound
 LIBS += -lz -lvcddec -lvcdcom
+LIBS += -lcrypto
+
+# Public Ed25519 key the update manifest is signed with, as 64 hex digits
+!isEmpty(KALAMI_UPDATE_PUBLIC_KEY): DEFINES += KALAMI_UPDATE_PUBLIC_KEY=\\\"$$KALAMI_UPDATE_PUBLIC_KEY\\\"
 
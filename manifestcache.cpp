@@ -0,0 +1,126 @@
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QJsonObject>
+#include <QJsonDocument>
+
+#include "manifestcache.h"
+
+Q_LOGGING_CATEGORY(ManifestCacheLog, "ManifestCache")
+
+const QString ManifestCache::directory = "/var/cache/kalami";
+
+static bool writeFile(const QString &path, const QByteArray &data)
+{
+    QSaveFile file(path);
+
+    if (!file.open(QFile::WriteOnly)) {
+        qWarning(ManifestCacheLog) << "Unable to write" << path << ":" << file.errorString();
+        return false;
+    }
+
+    file.write(data);
+    if (!file.commit()) {
+        qWarning(ManifestCacheLog) << "Unable to commit" << path << ":" << file.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+ManifestCache::ManifestCache() :
+    url(), content(), signatureContent(), etag(), lastModified()
+{
+}
+
+bool ManifestCache::load(const QUrl &requestUrl)
+{
+    url = requestUrl;
+    content.clear();
+    signatureContent.clear();
+    etag.clear();
+    lastModified.clear();
+
+    QFile meta(directory + "/manifest.meta");
+    if (!meta.open(QFile::ReadOnly))
+        return false;
+
+    QJsonDocument doc = QJsonDocument::fromJson(meta.readAll());
+    if (!doc.isObject())
+        return false;
+
+    QJsonObject json = doc.object();
+
+    if (json["url"].toString() != url.toString())
+        return false;
+
+    QFile file(directory + "/manifest.json");
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    QFile signatureFile(directory + "/manifest.json.sig");
+    if (!signatureFile.open(QFile::ReadOnly))
+        return false;
+
+    content = file.readAll();
+    signatureContent = signatureFile.readAll();
+    etag = json["etag"].toString().toLatin1();
+    lastModified = json["last_modified"].toString().toLatin1();
+
+    // Without a validator, there's nothing to revalidate the copy with
+    if (content.isEmpty() || signatureContent.isEmpty() || (etag.isEmpty() && lastModified.isEmpty())) {
+        content.clear();
+        signatureContent.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool ManifestCache::store(const QByteArray &manifest, const QByteArray &signature,
+                          const QByteArray &newEtag, const QByteArray &newLastModified)
+{
+    QDir().mkpath(directory);
+
+    QJsonObject json {
+        { "url", url.toString() },
+        { "etag", QString::fromLatin1(newEtag) },
+        { "last_modified", QString::fromLatin1(newLastModified) },
+    };
+
+    // The metadata goes last, so it never refers to a partially written copy
+    QFile::remove(directory + "/manifest.meta");
+
+    if (!writeFile(directory + "/manifest.json", manifest) ||
+        !writeFile(directory + "/manifest.json.sig", signature) ||
+        !writeFile(directory + "/manifest.meta", QJsonDocument(json).toJson(QJsonDocument::Compact)))
+        return false;
+
+    content = manifest;
+    signatureContent = signature;
+    etag = newEtag;
+    lastModified = newLastModified;
+
+    return true;
+}
+
+void ManifestCache::clear()
+{
+    content.clear();
+    signatureContent.clear();
+    etag.clear();
+    lastModified.clear();
+    QFile::remove(directory + "/manifest.meta");
+}
+
+void ManifestCache::addConditionalHeaders(QNetworkRequest *request) const
+{
+    if (!isValid())
+        return;
+
+    if (!etag.isEmpty())
+        request->setRawHeader("If-None-Match", etag);
+
+    if (!lastModified.isEmpty())
+        request->setRawHeader("If-Modified-Since", lastModified);
+}
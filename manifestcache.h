@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QUrl>
+#include <QString>
+#include <QByteArray>
+#include <QNetworkRequest>
+#include <QtCore/QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(ManifestCacheLog)
+
+//
+// ManifestCache keeps the last update manifest whose signature was verified,
+// along with the signature and the validators (ETag, Last-Modified) the server
+// sent for it. Checks revalidate the cached copy with a conditional request,
+// and a 304 response lets them reuse it and its signature without another
+// transfer. The signature is verified again before the copy is trusted. The
+// cache only matches requests for the same URL.
+//
+
+class ManifestCache
+{
+public:
+    ManifestCache();
+
+    bool load(const QUrl &url);
+    bool store(const QByteArray &manifest, const QByteArray &signature,
+               const QByteArray &etag, const QByteArray &lastModified);
+    void clear();
+
+    void addConditionalHeaders(QNetworkRequest *request) const;
+
+    bool isValid() const { return !content.isEmpty(); }
+    const QByteArray &manifest() const { return content; }
+    const QByteArray &signature() const { return signatureContent; }
+
+private:
+    static const QString directory;
+
+    QUrl url;
+    QByteArray content;
+    QByteArray signatureContent;
+    QByteArray etag;
+    QByteArray lastModified;
+};
@@ -0,0 +1,493 @@
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "sha512.h"
+
+// FIPS 180-4, section 4.2.3
+static const uint64_t K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const uint64_t initialHash[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const uint32_t stateMagic = 0x53513531; // "SQ51"
+
+static inline uint64_t ror(uint64_t x, int n)
+{
+    return (x >> n) | (x << (64 - n));
+}
+
+static inline uint64_t loadBE64(const uint8_t *p)
+{
+    return ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) |
+           ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32) |
+           ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+           ((uint64_t) p[6] << 8)  | ((uint64_t) p[7]);
+}
+
+static inline void storeBE64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+Sha512::Sha512()
+{
+    reset();
+}
+
+void Sha512::reset()
+{
+    memset(&st, 0, sizeof(st));
+    st.magic = stateMagic;
+    memcpy(st.h, initialHash, sizeof(st.h));
+}
+
+static void transformGeneric(uint64_t h[8], const uint8_t *blocks, size_t numBlocks)
+{
+    uint64_t w[80];
+
+    while (numBlocks--) {
+        for (int i = 0; i < 16; i++)
+            w[i] = loadBE64(blocks + i * 8);
+
+        for (int i = 16; i < 80; i++) {
+            uint64_t s0 = ror(w[i - 15], 1) ^ ror(w[i - 15], 8) ^ (w[i - 15] >> 7);
+            uint64_t s1 = ror(w[i - 2], 19) ^ ror(w[i - 2], 61) ^ (w[i - 2] >> 6);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint64_t a = h[0], b = h[1], c = h[2], d = h[3];
+        uint64_t e = h[4], f = h[5], g = h[6], k = h[7];
+
+        for (int i = 0; i < 80; i++) {
+            uint64_t S1 = ror(e, 14) ^ ror(e, 18) ^ ror(e, 41);
+            uint64_t ch = (e & f) ^ (~e & g);
+            uint64_t t1 = k + S1 + ch + K[i] + w[i];
+            uint64_t S0 = ror(a, 28) ^ ror(a, 34) ^ ror(a, 39);
+            uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint64_t t2 = S0 + maj;
+
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+
+        blocks += Sha512::blockLength;
+    }
+}
+
+#if defined(__aarch64__)
+//
+// ARMv8.2 SHA512 instructions. The state is kept in four vectors holding
+// {a, b}, {c, d}, {e, f} and {g, h}, and every SHA512H/SHA512H2 pair performs
+// two rounds, after which the roles of the vectors rotate.
+//
+__attribute__((target("arch=armv8.2-a+sha3")))
+static void transformArmv8(uint64_t h[8], const uint8_t *blocks, size_t numBlocks)
+{
+    uint64x2_t ab = vld1q_u64(h + 0);
+    uint64x2_t cd = vld1q_u64(h + 2);
+    uint64x2_t ef = vld1q_u64(h + 4);
+    uint64x2_t gh = vld1q_u64(h + 6);
+
+    while (numBlocks--) {
+        uint64x2_t w[40];
+
+        for (int i = 0; i < 8; i++)
+            w[i] = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(blocks + i * 16)));
+
+        for (int i = 8; i < 40; i++)
+            w[i] = vsha512su1q_u64(vsha512su0q_u64(w[i - 8], w[i - 7]), w[i - 1], vextq_u64(w[i - 4], w[i - 3], 1));
+
+        uint64x2_t ab0 = ab, cd0 = cd, ef0 = ef, gh0 = gh;
+
+        for (int i = 0; i < 40; i++) {
+            uint64x2_t wk = vaddq_u64(w[i], vld1q_u64(K + i * 2));
+            wk = vaddq_u64(vextq_u64(wk, wk, 1), gh);
+
+            uint64x2_t t1 = vsha512hq_u64(wk, vextq_u64(ef, gh, 1), vextq_u64(cd, ef, 1));
+            uint64x2_t next = vsha512h2q_u64(t1, cd, ab);
+
+            gh = ef;
+            ef = vaddq_u64(cd, t1);
+            cd = ab;
+            ab = next;
+        }
+
+        ab = vaddq_u64(ab, ab0);
+        cd = vaddq_u64(cd, cd0);
+        ef = vaddq_u64(ef, ef0);
+        gh = vaddq_u64(gh, gh0);
+
+        blocks += Sha512::blockLength;
+    }
+
+    vst1q_u64(h + 0, ab);
+    vst1q_u64(h + 2, cd);
+    vst1q_u64(h + 4, ef);
+    vst1q_u64(h + 6, gh);
+}
+#endif
+
+#if defined(__x86_64__)
+//
+// Four independent messages hashed in the 64 bit lanes of AVX2 registers.
+// Lane n of every vector belongs to message n.
+//
+#define ROR4(x, n) _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+
+__attribute__((target("avx2")))
+static void transform4Avx2(uint64_t h[4][8], const uint8_t *const blocks[4], size_t numBlocks)
+{
+    __m256i st[8];
+
+    for (int i = 0; i < 8; i++)
+        st[i] = _mm256_set_epi64x(h[3][i], h[2][i], h[1][i], h[0][i]);
+
+    for (size_t n = 0; n < numBlocks; n++) {
+        __m256i w[80];
+        size_t offset = n * Sha512::blockLength;
+
+        for (int i = 0; i < 16; i++)
+            w[i] = _mm256_set_epi64x(loadBE64(blocks[3] + offset + i * 8), loadBE64(blocks[2] + offset + i * 8),
+                                     loadBE64(blocks[1] + offset + i * 8), loadBE64(blocks[0] + offset + i * 8));
+
+        for (int i = 16; i < 80; i++) {
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR4(w[i - 15], 1), ROR4(w[i - 15], 8)),
+                                          _mm256_srli_epi64(w[i - 15], 7));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR4(w[i - 2], 19), ROR4(w[i - 2], 61)),
+                                          _mm256_srli_epi64(w[i - 2], 6));
+            w[i] = _mm256_add_epi64(_mm256_add_epi64(w[i - 16], s0), _mm256_add_epi64(w[i - 7], s1));
+        }
+
+        __m256i a = st[0], b = st[1], c = st[2], d = st[3];
+        __m256i e = st[4], f = st[5], g = st[6], k = st[7];
+
+        for (int i = 0; i < 80; i++) {
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(ROR4(e, 14), ROR4(e, 18)), ROR4(e, 41));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi64(_mm256_add_epi64(k, S1),
+                                          _mm256_add_epi64(_mm256_add_epi64(ch, w[i]), _mm256_set1_epi64x(K[i])));
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(ROR4(a, 28), ROR4(a, 34)), ROR4(a, 39));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, _mm256_or_si256(b, c)), _mm256_and_si256(b, c));
+            __m256i t2 = _mm256_add_epi64(S0, maj);
+
+            k = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi64(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi64(t1, t2);
+        }
+
+        st[0] = _mm256_add_epi64(st[0], a); st[1] = _mm256_add_epi64(st[1], b);
+        st[2] = _mm256_add_epi64(st[2], c); st[3] = _mm256_add_epi64(st[3], d);
+        st[4] = _mm256_add_epi64(st[4], e); st[5] = _mm256_add_epi64(st[5], f);
+        st[6] = _mm256_add_epi64(st[6], g); st[7] = _mm256_add_epi64(st[7], k);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        uint64_t lanes[4];
+
+        _mm256_storeu_si256((__m256i *) lanes, st[i]);
+
+        for (int n = 0; n < 4; n++)
+            h[n][i] = lanes[n];
+    }
+}
+
+#undef ROR4
+#endif
+
+struct Sha512Backend {
+    const char *name;
+    void (*transform)(uint64_t h[8], const uint8_t *blocks, size_t numBlocks);
+    void (*transform4)(uint64_t h[4][8], const uint8_t *const blocks[4], size_t numBlocks);
+};
+
+static const Sha512Backend backends[] = {
+    { "generic", transformGeneric, NULL },
+#if defined(__aarch64__)
+    { "armv8", transformArmv8, NULL },
+#endif
+#if defined(__x86_64__)
+    { "avx2", transformGeneric, transform4Avx2 },
+#endif
+};
+
+static const int numBackends = sizeof(backends) / sizeof(backends[0]);
+
+static bool backendSupported(const Sha512Backend &b)
+{
+#if defined(__aarch64__)
+    if (b.transform == transformArmv8 && !(getauxval(AT_HWCAP) & HWCAP_SHA512))
+        return false;
+#endif
+#if defined(__x86_64__)
+    if (b.transform4 == transform4Avx2 && !__builtin_cpu_supports("avx2"))
+        return false;
+#endif
+
+    // Never trust an accelerated implementation that disagrees with the
+    // portable one, as that would fail every update.
+    uint8_t blocks[4][Sha512::blockLength];
+    uint64_t expected[8], h[8], h4[4][8];
+
+    for (int n = 0; n < 4; n++)
+        for (int i = 0; i < Sha512::blockLength; i++)
+            blocks[n][i] = i * 7 + n;
+
+    memcpy(expected, initialHash, sizeof(expected));
+    transformGeneric(expected, blocks[3], 1);
+
+    memcpy(h, initialHash, sizeof(h));
+    b.transform(h, blocks[3], 1);
+
+    if (memcmp(h, expected, sizeof(h)) != 0)
+        return false;
+
+    if (b.transform4) {
+        const uint8_t *p[4] = { blocks[0], blocks[1], blocks[2], blocks[3] };
+
+        for (int n = 0; n < 4; n++)
+            memcpy(h4[n], initialHash, sizeof(h4[n]));
+
+        b.transform4(h4, p, 1);
+
+        if (memcmp(h4[3], expected, sizeof(expected)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static const Sha512Backend *defaultBackend()
+{
+    // The last supported entry is the fastest one
+    for (int i = numBackends - 1; i > 0; i--)
+        if (backendSupported(backends[i]))
+            return &backends[i];
+
+    return &backends[0];
+}
+
+static const Sha512Backend *currentBackend(const Sha512Backend *select = NULL)
+{
+    static const Sha512Backend *current = defaultBackend();
+
+    if (select)
+        current = select;
+
+    return current;
+}
+
+void Sha512::transform(uint64_t h[8], const uint8_t *blocks, size_t numBlocks)
+{
+    currentBackend()->transform(h, blocks, numBlocks);
+}
+
+QString Sha512::backend()
+{
+    return currentBackend()->name;
+}
+
+QStringList Sha512::availableBackends()
+{
+    QStringList names;
+
+    for (int i = 0; i < numBackends; i++)
+        if (backendSupported(backends[i]))
+            names << backends[i].name;
+
+    return names;
+}
+
+bool Sha512::setBackend(const QString &name)
+{
+    for (int i = 0; i < numBackends; i++) {
+        if (name == backends[i].name && backendSupported(backends[i])) {
+            currentBackend(&backends[i]);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t Sha512::padTail(uint8_t tail[2 * blockLength], const uint8_t *rest, size_t restLength, uint64_t length)
+{
+    memset(tail, 0, 2 * blockLength);
+    memcpy(tail, rest, restLength);
+    tail[restLength++] = 0x80;
+
+    // The message length is appended as a 128 bit big endian number of bits
+    size_t blocks = restLength + 16 > (size_t) blockLength ? 2 : 1;
+    uint8_t *lengthField = tail + blocks * blockLength - 16;
+    storeBE64(lengthField, length >> 61);
+    storeBE64(lengthField + 8, length << 3);
+
+    return blocks;
+}
+
+void Sha512::hashMany(const char *const *messages, int count, size_t length, QByteArray *digests)
+{
+    int i = 0;
+
+#if defined(__x86_64__)
+    const Sha512Backend *b = currentBackend();
+
+    for (; b->transform4 && i + 4 <= count; i += 4) {
+        uint64_t h[4][8];
+        uint8_t tails[4][2 * blockLength];
+        const uint8_t *p[4];
+        size_t full = length / blockLength;
+        size_t blocks = 0;
+
+        for (int n = 0; n < 4; n++) {
+            memcpy(h[n], initialHash, sizeof(h[n]));
+            p[n] = (const uint8_t *) messages[i + n];
+        }
+
+        b->transform4(h, p, full);
+
+        for (int n = 0; n < 4; n++) {
+            blocks = padTail(tails[n], p[n] + full * blockLength, length % blockLength, length);
+            p[n] = tails[n];
+        }
+
+        b->transform4(h, p, blocks);
+
+        for (int n = 0; n < 4; n++) {
+            digests[i + n].resize(digestLength);
+
+            for (int j = 0; j < 8; j++)
+                storeBE64((uint8_t *) digests[i + n].data() + j * 8, h[n][j]);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        Sha512 hash;
+
+        hash.addData(messages[i], length);
+        digests[i] = hash.result();
+    }
+}
+
+void Sha512::addData(const char *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    st.length += length;
+
+    if (st.bufferLength > 0) {
+        size_t l = qMin(length, (size_t) blockLength - st.bufferLength);
+
+        memcpy(st.buffer + st.bufferLength, p, l);
+        st.bufferLength += l;
+        p += l;
+        length -= l;
+
+        if (st.bufferLength < blockLength)
+            return;
+
+        transform(st.h, st.buffer, 1);
+        st.bufferLength = 0;
+    }
+
+    if (length >= (size_t) blockLength) {
+        size_t n = length / blockLength;
+
+        transform(st.h, p, n);
+        p += n * blockLength;
+        length -= n * blockLength;
+    }
+
+    if (length > 0) {
+        memcpy(st.buffer, p, length);
+        st.bufferLength = length;
+    }
+}
+
+QByteArray Sha512::result() const
+{
+    uint64_t h[8];
+    uint8_t tail[blockLength * 2];
+
+    memcpy(h, st.h, sizeof(h));
+
+    size_t blocks = padTail(tail, st.buffer, st.bufferLength, st.length);
+    transform(h, tail, blocks);
+
+    QByteArray digest(digestLength, 0);
+    for (int i = 0; i < 8; i++)
+        storeBE64((uint8_t *) digest.data() + i * 8, h[i]);
+
+    return digest;
+}
+
+QByteArray Sha512::saveState() const
+{
+    return QByteArray((const char *) &st, sizeof(st));
+}
+
+bool Sha512::restoreState(const QByteArray &state)
+{
+    State s;
+
+    if (state.size() != sizeof(s))
+        return false;
+
+    memcpy(&s, state.constData(), sizeof(s));
+
+    if (s.magic != stateMagic || s.bufferLength >= (uint32_t) blockLength)
+        return false;
+
+    st = s;
+
+    return true;
+}
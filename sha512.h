@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QByteArray>
+#include <QStringList>
+
+#include <stdint.h>
+
+//
+// SHA512 implementation whose intermediate state can be saved and restored,
+// which QCryptographicHash doesn't allow. This is used to checkpoint the hash
+// of partially downloaded images, so an interrupted download can be resumed
+// without hashing everything before the checkpoint again.
+//
+// The block transform is picked at runtime by CPU features: SHA512
+// instructions on ARMv8.2, the portable implementation otherwise. hashMany()
+// hashes several independent messages of the same length at once, which uses
+// four AVX2 lanes on x86.
+//
+
+class Sha512
+{
+public:
+    Sha512();
+
+    void reset();
+    void addData(const char *data, size_t length);
+    void addData(const QByteArray &data) { addData(data.constData(), data.size()); }
+    QByteArray result() const;
+
+    QByteArray saveState() const;
+    bool restoreState(const QByteArray &state);
+
+    static void hashMany(const char *const *messages, int count, size_t length, QByteArray *digests);
+
+    static QString backend();
+    static QStringList availableBackends();
+    static bool setBackend(const QString &name);
+
+    static const int digestLength = 64;
+    static const int blockLength = 128;
+
+private:
+    struct State {
+        uint32_t magic;
+        uint32_t bufferLength;
+        uint64_t length;
+        uint64_t h[8];
+        uint8_t buffer[blockLength];
+    };
+
+    State st;
+
+    static void transform(uint64_t h[8], const uint8_t *blocks, size_t numBlocks);
+    static size_t padTail(uint8_t tail[2 * blockLength], const uint8_t *rest, size_t restLength, uint64_t length);
+};
@@ -0,0 +1,54 @@
+#include <openssl/evp.h>
+
+#include "signatureverifier.h"
+
+Q_LOGGING_CATEGORY(SignatureVerifierLog, "SignatureVerifier")
+
+SignatureVerifier::SignatureVerifier(const QByteArray &publicKey) :
+    key(publicKey)
+{
+}
+
+SignatureVerifier SignatureVerifier::pinned()
+{
+#ifdef KALAMI_UPDATE_PUBLIC_KEY
+    return SignatureVerifier(QByteArray::fromHex(KALAMI_UPDATE_PUBLIC_KEY));
+#else
+    return SignatureVerifier(QByteArray());
+#endif
+}
+
+bool SignatureVerifier::verify(const QByteArray &message, const QByteArray &signature) const
+{
+    if (!isValid())
+        return false;
+
+    QByteArray sig = signature;
+    if (sig.size() != signatureLength)
+        sig = QByteArray::fromBase64(signature.trimmed());
+
+    if (sig.size() != signatureLength) {
+        qWarning(SignatureVerifierLog) << "Invalid signature length" << signature.size();
+        return false;
+    }
+
+    EVP_PKEY *pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL,
+                                                 (const unsigned char *) key.constData(), key.size());
+    if (!pkey) {
+        qWarning(SignatureVerifierLog) << "Unable to load public key";
+        return false;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ret = false;
+
+    // Ed25519 hashes the message itself, so there is no separate digest
+    if (ctx && EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1)
+        ret = EVP_DigestVerify(ctx, (const unsigned char *) sig.constData(), sig.size(),
+                               (const unsigned char *) message.constData(), message.size()) == 1;
+
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+
+    return ret;
+}
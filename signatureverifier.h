@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QByteArray>
+#include <QtCore/QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(SignatureVerifierLog)
+
+//
+// SignatureVerifier checks detached Ed25519 signatures over in-memory data.
+// The update manifest is signed with a single key, whose public part is pinned
+// at build time through the KALAMI_UPDATE_PUBLIC_KEY define (64 hex digits):
+//
+//   qmake KALAMI_UPDATE_PUBLIC_KEY=<hex>
+//
+// Signatures are accepted as 64 raw bytes or in base64 encoding.
+//
+
+class SignatureVerifier
+{
+public:
+    explicit SignatureVerifier(const QByteArray &publicKey);
+
+    bool isValid() const { return key.size() == keyLength; }
+    bool verify(const QByteArray &message, const QByteArray &signature) const;
+
+    static SignatureVerifier pinned();
+
+private:
+    static const int keyLength = 32;
+    static const int signatureLength = 64;
+
+    QByteArray key;
+};
@@ -0,0 +1,102 @@
+#include "streaminflater.h"
+
+Q_LOGGING_CATEGORY(StreamInflaterLog, "StreamInflater")
+
+bool CompressedManifest::isValid() const
+{
+    return url.isValid() && !codec.isEmpty() && length > 0;
+}
+
+CompressedManifest CompressedManifest::fromJson(const QJsonObject &json)
+{
+    CompressedManifest manifest;
+
+    manifest.url = QUrl(json["url"].toString());
+    manifest.codec = json["codec"].toString();
+    manifest.length = (qint64) json["length"].toDouble();
+
+    return manifest;
+}
+
+StreamInflater::StreamInflater(const QString &codec, qint64 expectedLength, Sink sink) :
+    stream(),
+    initialized(false),
+    streamEnd(false),
+    expectedLength(expectedLength),
+    totalOut(0),
+    sink(sink),
+    output(new char[outputSize])
+{
+    if (!supports(codec)) {
+        qWarning(StreamInflaterLog) << "Unsupported codec" << codec;
+        return;
+    }
+
+    // 15 bits of window, plus 16 to expect a gzip header
+    initialized = inflateInit2(&stream, 15 + 16) == Z_OK;
+}
+
+StreamInflater::~StreamInflater()
+{
+    if (initialized)
+        inflateEnd(&stream);
+
+    delete[] output;
+}
+
+bool StreamInflater::supports(const QString &codec)
+{
+    return codec == "gzip";
+}
+
+bool StreamInflater::inflate(const char *data, qint64 length)
+{
+    if (!initialized)
+        return false;
+
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = length;
+
+    forever {
+        // Concatenated gzip members, as written by parallel compressors,
+        // form a single image.
+        if (streamEnd) {
+            if (stream.avail_in == 0)
+                break;
+
+            if (inflateReset(&stream) != Z_OK)
+                return false;
+
+            streamEnd = false;
+        }
+
+        stream.next_out = (Bytef *) output;
+        stream.avail_out = outputSize;
+
+        int ret = ::inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            qWarning(StreamInflaterLog) << "Decompression failed:" << (stream.msg ? stream.msg : "unknown error");
+            return false;
+        }
+
+        qint64 produced = outputSize - stream.avail_out;
+        totalOut += produced;
+
+        if (totalOut > expectedLength) {
+            qWarning(StreamInflaterLog) << "Decompressed image exceeds expected length" << expectedLength;
+            return false;
+        }
+
+        if (produced > 0 && !sink(output, produced))
+            return false;
+
+        // A full output buffer may leave more output pending in zlib, even
+        // when all input has been consumed.
+        if (ret == Z_STREAM_END)
+            streamEnd = true;
+        else if (ret == Z_BUF_ERROR || (stream.avail_in == 0 && stream.avail_out > 0))
+            break;
+    }
+
+    return true;
+}
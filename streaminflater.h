@@ -0,0 +1,64 @@
+#pragma once
+
+#include <QUrl>
+#include <QString>
+#include <QJsonObject>
+#include <QtCore/QLoggingCategory>
+
+#include <functional>
+
+#include <zlib.h>
+
+Q_DECLARE_LOGGING_CATEGORY(StreamInflaterLog)
+
+//
+// Compressed variant of a full image as published in the update Json:
+//
+//   "rootfs_compressed": { "url": "<url>", "codec": "gzip", "length": <image length> }
+//
+// The length is that of the uncompressed image, whose SHA512 is the one
+// published for the image itself.
+//
+
+struct CompressedManifest {
+    QUrl url;
+    QString codec;
+    qint64 length;
+
+    CompressedManifest() : length(0) {}
+    bool isValid() const;
+    static CompressedManifest fromJson(const QJsonObject &json);
+};
+
+//
+// StreamInflater decompresses an image as it arrives from the network and
+// hands the output to a sink in pieces of at most outputSize bytes. Output
+// beyond the expected length is treated as an error, so a corrupt or hostile
+// stream can't write past the image.
+//
+
+class StreamInflater
+{
+public:
+    typedef std::function<bool(const char *data, qint64 length)> Sink;
+
+    StreamInflater(const QString &codec, qint64 expectedLength, Sink sink);
+    ~StreamInflater();
+
+    static bool supports(const QString &codec);
+
+    bool isValid() const { return initialized; }
+    bool inflate(const char *data, qint64 length);
+    bool finished() const { return streamEnd && totalOut == expectedLength; }
+
+private:
+    static const qint64 outputSize = 256 * 1024;
+
+    z_stream stream;
+    bool initialized;
+    bool streamEnd;
+    qint64 expectedLength;
+    qint64 totalOut;
+    Sink sink;
+    char *output;
+};
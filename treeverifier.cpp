@@ -0,0 +1,124 @@
+#include <QJsonValue>
+#include <QThread>
+
+#include "treeverifier.h"
+#include "sha512.h"
+
+Q_LOGGING_CATEGORY(TreeVerifierLog, "TreeVerifier")
+
+const int TreeVerifier::leavesPerGroup;
+
+bool TreeManifest::isValid() const
+{
+    // Every worker buffers a group of leaves, and leaves are counted in ints.
+    // A power of two keeps the reads aligned to the device's blocks.
+    if (blockSize < TreeManifest::minBlockSize || blockSize > TreeManifest::maxBlockSize ||
+        (blockSize & (blockSize - 1)) != 0)
+        return false;
+
+    return length > 0 && root.size() == Sha512::digestLength * 2;
+}
+
+TreeManifest TreeManifest::fromJson(const QJsonObject &json)
+{
+    TreeManifest manifest;
+
+    manifest.blockSize = (qint64) json["block_size"].toDouble();
+    manifest.length = (qint64) json["length"].toDouble();
+    manifest.root = json["root"].toString().toLower();
+
+    return manifest;
+}
+
+TreeVerifier::TreeVerifier(BlockDevice *image, const TreeManifest &manifest, IoThrottler *throttler, QObject *parent) :
+    QObject(parent),
+    image(image),
+    manifest(manifest),
+    throttler(throttler),
+    pool(this),
+    numLeaves((manifest.length + manifest.blockSize - 1) / manifest.blockSize),
+    leaves(numLeaves),
+    leafData(leaves.data()),
+    nextGroup(0),
+    leavesDone(0),
+    failed(0)
+{
+}
+
+void TreeVerifier::hashLeaves()
+{
+    QByteArray buf(manifest.blockSize * TreeVerifier::leavesPerGroup, Qt::Uninitialized);
+
+    while (!failed.load()) {
+        int first = nextGroup.fetchAndAddRelaxed(1) * TreeVerifier::leavesPerGroup;
+        if (first >= numLeaves)
+            return;
+
+        int count = qMin(TreeVerifier::leavesPerGroup, numLeaves - first);
+        qint64 offset = first * manifest.blockSize;
+        qint64 length = qMin(count * manifest.blockSize, manifest.length - offset);
+
+        if (image->readAt(buf.data(), length, offset) != length) {
+            qWarning(TreeVerifierLog) << "Unable to read" << image->fileName() << "at offset" << offset;
+            failed.store(1);
+            return;
+        }
+
+        // Leaves of full size are hashed side by side, a short last one alone
+        int full = length / manifest.blockSize;
+        const char *blocks[TreeVerifier::leavesPerGroup];
+
+        for (int i = 0; i < full; i++)
+            blocks[i] = buf.constData() + i * manifest.blockSize;
+
+        Sha512::hashMany(blocks, full, manifest.blockSize, leafData + first);
+
+        if (full < count) {
+            Sha512 hash;
+
+            hash.addData(buf.constData() + full * manifest.blockSize, length - full * manifest.blockSize);
+            leafData[first + full] = hash.result();
+        }
+
+        if (throttler)
+            throttler->throttle(length);
+
+        leavesDone.fetchAndAddRelaxed(count);
+    }
+}
+
+bool TreeVerifier::verify()
+{
+    int workers = qMax(1, QThread::idealThreadCount());
+
+    pool.setMaxThreadCount(workers);
+
+    qInfo(TreeVerifierLog) << "Verifying" << numLeaves << "leaves of" << image->fileName()
+                           << "with" << workers << "threads";
+
+    for (int i = 0; i < workers; i++)
+        pool.start(new TreeVerifier::Worker(this));
+
+    while (!pool.waitForDone(100))
+        emit progress(qMin((qint64) leavesDone.load() * manifest.blockSize, manifest.length), manifest.length);
+
+    emit progress(manifest.length, manifest.length);
+
+    if (failed.load())
+        return false;
+
+    Sha512 root;
+
+    for (int i = 0; i < numLeaves; i++)
+        root.addData(leaves[i]);
+
+    QString digest = root.result().toHex();
+
+    if (digest != manifest.root) {
+        qInfo(TreeVerifierLog) << "Tree hash mismatch for" << image->fileName() << ":"
+                               << digest << "!=" << manifest.root;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QVector>
+#include <QJsonObject>
+#include <QtCore/QLoggingCategory>
+
+#include "blockdevice.h"
+#include "iothrottler.h"
+
+Q_DECLARE_LOGGING_CATEGORY(TreeVerifierLog)
+
+//
+// Tree hash of an image as published in the update Json:
+//
+//   "rootfs_tree": { "block_size": <leaf size>, "length": <image length>, "root": "<sha512>" }
+//
+// Every leaf is the SHA512 of one block of the image, the last one possibly
+// shorter. The root is the SHA512 of all leaf digests concatenated in order.
+// The leaf size must be a power of two from 4 KiB to 4 MiB.
+//
+
+struct TreeManifest {
+    static const qint64 minBlockSize = 4 * 1024;
+    static const qint64 maxBlockSize = 4 * 1024 * 1024;
+
+    qint64 blockSize;
+    qint64 length;
+    QString root;
+
+    TreeManifest() : blockSize(0), length(0) {}
+    bool isValid() const;
+    static TreeManifest fromJson(const QJsonObject &json);
+};
+
+//
+// TreeVerifier computes the leaves of a tree hash on all cores. Workers claim
+// groups of adjacent leaves, read them with their own positional reads and
+// hash the group in parallel lanes where the CPU allows. Once all leaves are
+// known, the root is computed and compared with the manifest.
+//
+
+class TreeVerifier : public QObject
+{
+    Q_OBJECT
+
+public:
+    TreeVerifier(BlockDevice *image, const TreeManifest &manifest, IoThrottler *throttler = NULL, QObject *parent = 0);
+
+    bool verify();
+
+signals:
+    void progress(qint64 bytesDone, qint64 bytesTotal);
+
+private:
+    static const int leavesPerGroup = 4;
+
+    class Worker : public QRunnable
+    {
+    public:
+        explicit Worker(TreeVerifier *verifier) : verifier(verifier) {}
+        void run() Q_DECL_OVERRIDE { verifier->hashLeaves(); }
+
+    private:
+        TreeVerifier *verifier;
+    };
+
+    BlockDevice *image;
+    TreeManifest manifest;
+    IoThrottler *throttler;
+    QThreadPool pool;
+
+    int numLeaves;
+    QVector<QByteArray> leaves;
+    QByteArray *leafData;
+    QAtomicInt nextGroup;
+    QAtomicInt leavesDone;
+    QAtomicInt failed;
+
+    void hashLeaves();
+};
@@ -4,22 +4,31 @@
 #include <QJsonObject>
 #include <QJsonDocument>
 #include <QJsonParseError>
-#include <QProcess>
 #include <QFile>
 #include <QEventLoop>
 #include <QTimer>
 #include <QFileInfo>
+#include <QVector>
+#include <QScopedPointer>
 
 #include <math.h>
 
 #include "updater.h"
+#include "imagepipeline.h"
+#include "vcdiffoutput.h"
+#include "downloadjournal.h"
+#include "signatureverifier.h"
 
 Q_LOGGING_CATEGORY(UpdaterLog, "Updater")
 
+const qint64 UpdateThread::verifyBufferSize;
+
 Updater::Updater(const Machine *machine, QObject *parent) :
     QObject(parent), machine(machine), networkAccessManager(this)
 {
     pendingReply = NULL;
+    gpg = NULL;
+    nativeSignature = false;
     thread = NULL;
     state = Updater::StateUndefined;
     installedUpdateVersion = QString();
@@ -30,6 +39,8 @@ Updater::~Updater()
 {
     if (pendingReply)
         pendingReply->abort();
+
+    abortVerification();
 }
 
 const QString &Updater::getUpdateSeed(Updater::ImageType type) const
@@ -58,41 +69,118 @@ const QString &Updater::getUpdateTarget(Updater::ImageType type) const
     return NULL;
 }
 
-bool Updater::verifySignature(const QString &contentFile, const QString &signatureFile)
+void Updater::reportStep(const char *step)
+{
+    qInfo(UpdaterLog) << "Update check:" << step << "took" << stateTimer.restart() << "ms,"
+                      << checkTimer.elapsed() << "ms in total";
+}
+
+void Updater::abortVerification()
 {
-    QProcess gpg;
+    if (!gpg)
+        return;
+
+    gpg->disconnect(this);
+    gpg->kill();
+    gpg->deleteLater();
+    gpg = NULL;
+}
+
+void Updater::verifySignature(const QByteArray &content, const QByteArray &signature)
+{
+    if (nativeSignature) {
+        // Takes microseconds, so there's no need to leave the event loop
+        signatureVerified(SignatureVerifier::pinned().verify(content, signature));
+        return;
+    }
+
+    // Builds without a pinned key fall back to the system's gpg keyring. gpg
+    // runs asynchronously and reports back through signatureVerified().
+    QFile contentFile("/tmp/update.json");
+    QFile signatureFile("/tmp/update.json.sig");
+
+    if (!contentFile.open(QFileDevice::WriteOnly) || !signatureFile.open(QFileDevice::WriteOnly)) {
+        qWarning(UpdaterLog) << "Unable to write" << contentFile.fileName() << "and" << signatureFile.fileName();
+        signatureVerified(false);
+        return;
+    }
+
+    contentFile.write(content);
+    contentFile.close();
+    signatureFile.write(signature);
+    signatureFile.close();
+
     QStringList arguments;
+    arguments << "--quiet" << "--verify" << signatureFile.fileName() << contentFile.fileName();
 
-    arguments << "--quiet" << "--verify" << signatureFile << contentFile;
+    gpg = new QProcess(this);
 
-    gpg.start("/usr/bin/gpg", arguments);
-    if (!gpg.waitForFinished())
-        return false;
+    QObject::connect(gpg, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+                     this, [this](int exitCode, QProcess::ExitStatus exitStatus) {
+        gpg->deleteLater();
+        gpg = NULL;
+        signatureVerified(exitStatus == QProcess::NormalExit && exitCode == 0);
+    });
+
+    QObject::connect(gpg, &QProcess::errorOccurred, this, [this](QProcess::ProcessError error) {
+        if (error != QProcess::FailedToStart)
+            return;
+
+        qWarning(UpdaterLog) << "Unable to start gpg:" << gpg->errorString();
+        gpg->deleteLater();
+        gpg = NULL;
+        signatureVerified(false);
+    });
 
-    return gpg.exitCode() == 0;
+    gpg->start("/usr/bin/gpg", arguments);
+}
+
+static QList<Delta> deltaIndex(const QJsonObject &json, const QString &image, const QString &from, const QString &to)
+{
+    QList<Delta> deltas = Delta::listFromJson(json[image + "_delta_index"].toArray());
+
+    // Older manifests only offer a delta from each previous build, at a URL
+    // derived from its build id.
+    if (deltas.isEmpty()) {
+        Delta delta;
+
+        delta.from = from;
+        delta.to = to;
+        delta.url = QUrl(json[image + "_deltas"].toString() + from + ".vcdiff");
+        deltas.append(delta);
+    }
+
+    return deltas;
 }
 
 void Updater::downloadFinished()
 {
     QNetworkReply *reply = (QNetworkReply *) sender();
-    QByteArray content = reply->readAll();
+    QElapsedTimer busy;
 
+    busy.start();
+
+    QByteArray content = reply->readAll();
     pendingReply = NULL;
     reply->deleteLater();
 
     switch (state) {
     case Updater::StateDownloadJson: {
+        // An unchanged manifest is taken from the cache. Its signature is
+        // checked again, as the copy on disk could have been tampered with,
+        // but nothing needs to be downloaded.
+        int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        bool unchanged = status == 304 && manifestCache.isValid();
+
+        if (unchanged)
+            content = manifestCache.manifest();
+
         QJsonParseError jsonError;
         QJsonDocument doc = QJsonDocument::fromJson(content, &jsonError);
 
-        QFile file("/tmp/update.json");
-        if (!file.open(QFileDevice::WriteOnly)) {
-            qWarning(UpdaterLog) << "Unable to write" << file.fileName();
-            break;
-        }
-
-        file.write(content);
-        file.close();
+        manifest = content;
+        manifestETag = reply->rawHeader("ETag");
+        manifestLastModified = reply->rawHeader("Last-Modified");
 
         if (!doc.isObject() || jsonError.error != QJsonParseError::NoError) {
             emit checkFailed("Unable to parse Json content from update server:" + jsonError.errorString());
@@ -107,10 +195,38 @@ void Updater::downloadFinished()
         availableUpdate.rootfsSha512 = json["rootfs_sha512"].toString();
         availableUpdate.bootimgUrl = QUrl(json["bootimg"].toString());
         availableUpdate.bootimgSha512 = json["bootimg_sha512"].toString();
-        availableUpdate.rootfsDeltaUrl = QUrl(json["rootfs_deltas"].toString() + version + ".vcdiff");
-        availableUpdate.bootimgDeltaUrl = QUrl(json["bootimg_deltas"].toString() + version + ".vcdiff");
+        availableUpdate.currentVersion = version;
+        availableUpdate.rootfsDeltas = deltaIndex(json, "rootfs", version, availableUpdate.version);
+        availableUpdate.bootimgDeltas = deltaIndex(json, "bootimg", version, availableUpdate.version);
+        availableUpdate.rootfsChunks = ChunkManifest::fromJson(json["rootfs_chunks"].toObject());
+        availableUpdate.bootimgChunks = ChunkManifest::fromJson(json["bootimg_chunks"].toObject());
+        availableUpdate.rootfsBlocks = BlockManifest::fromJson(json["rootfs_blockmap"].toObject());
+        availableUpdate.bootimgBlocks = BlockManifest::fromJson(json["bootimg_blockmap"].toObject());
+        availableUpdate.rootfsTree = TreeManifest::fromJson(json["rootfs_tree"].toObject());
+        availableUpdate.bootimgTree = TreeManifest::fromJson(json["bootimg_tree"].toObject());
+        availableUpdate.rootfsCompressed = CompressedManifest::fromJson(json["rootfs_compressed"].toObject());
+        availableUpdate.bootimgCompressed = CompressedManifest::fromJson(json["bootimg_compressed"].toObject());
+
+        // Prefer the Ed25519 signature, which is checked in-process against the
+        // pinned key, over spawning gpg.
+        nativeSignature = SignatureVerifier::pinned().isValid() && json.contains("signature_ed25519");
+
+        if (unchanged) {
+            reportStep("manifest revalidation");
+
+            // The validators are already in the cache
+            manifestETag.clear();
+            manifestLastModified.clear();
+
+            state = Updater::StateVerifySignature;
+            manifestSignature = manifestCache.signature();
+            verifySignature(manifest, manifestSignature);
+            break;
+        }
+
+        reportStep("manifest download");
 
-        QNetworkRequest request(QUrl(json["signature"].toString()));
+        QNetworkRequest request(QUrl(json[nativeSignature ? "signature_ed25519" : "signature"].toString()));
         request.setMaximumRedirectsAllowed(0);
 
         state = Updater::StateDownloadSignature;
@@ -121,61 +237,74 @@ void Updater::downloadFinished()
         break;
     }
 
-    case Updater::StateDownloadSignature: {
-        QFile file("/tmp/update.json.sig");
-        if (!file.open(QFileDevice::WriteOnly)) {
-            qWarning(UpdaterLog) << "Unable to write" << file.fileName();
-            break;
-        }
-
-        file.write(content);
-        file.close();
+    case Updater::StateDownloadSignature:
+        reportStep("signature download");
 
         state = Updater::StateVerifySignature;
+        manifestSignature = content;
+        verifySignature(manifest, content);
 
-        if (!verifySignature("/tmp/update.json", "/tmp/update.json.sig")) {
-            availableUpdate.version.clear();
-            qWarning(UpdaterLog) << "Unable to verify signature!";
-            break;
-        }
+        break;
 
-        QStringList l = availableUpdate.version.split("-");
+    default:
+        break;
+    }
 
-        if (l.length() != 2) {
-            emit checkFailed("Cannot parse update version from server: " + availableUpdate.version);
-            break;
-        }
+    // The check shares the event loop with input handling, so every step has
+    // to return quickly.
+    if (busy.elapsed() > Updater::maxStepMs)
+        qWarning(UpdaterLog) << "Update check blocked the event loop for" << busy.elapsed() << "ms";
+}
 
-        unsigned long version = l[1].toULong();
+void Updater::signatureVerified(bool valid)
+{
+    reportStep(nativeSignature ? "Ed25519 verification" : "gpg verification");
 
-        if (installedUpdateVersion == availableUpdate.version) {
-            qInfo(UpdaterLog) << "Update to new version" << installedUpdateVersion
-                              << "succeeded already previously.";
-            emit alreadyUpToDate();
-            break;
-        }
+    if (!valid) {
+        availableUpdate.version.clear();
+        manifestCache.clear();
+        qWarning(UpdaterLog) << "Unable to verify signature!";
+        return;
+    }
 
-        if (l[0] != machine->getOsChannel()) {
-            qInfo(UpdaterLog) << "Channel of update" << l[0]
-                              << "differs from current device channel" << machine->getOsChannel();
-            qInfo(UpdaterLog) << "Forcing update to" << availableUpdate.version;
-            emit updateAvailable(availableUpdate.version);
-            break;
-        }
+    if (!manifestETag.isEmpty() || !manifestLastModified.isEmpty())
+        manifestCache.store(manifest, manifestSignature, manifestETag, manifestLastModified);
 
-        if (version > machine->getOsVersionNumber()) {
-            emit updateAvailable(availableUpdate.version);
-            break;
-        }
+    evaluateUpdate();
+}
+
+void Updater::evaluateUpdate()
+{
+    QStringList l = availableUpdate.version.split("-");
+
+    if (l.length() != 2) {
+        emit checkFailed("Cannot parse update version from server: " + availableUpdate.version);
+        return;
+    }
+
+    unsigned long version = l[1].toULong();
 
+    if (installedUpdateVersion == availableUpdate.version) {
+        qInfo(UpdaterLog) << "Update to new version" << installedUpdateVersion
+                          << "succeeded already previously.";
         emit alreadyUpToDate();
+        return;
+    }
 
-        break;
+    if (l[0] != machine->getOsChannel()) {
+        qInfo(UpdaterLog) << "Channel of update" << l[0]
+                          << "differs from current device channel" << machine->getOsChannel();
+        qInfo(UpdaterLog) << "Forcing update to" << availableUpdate.version;
+        emit updateAvailable(availableUpdate.version);
+        return;
     }
 
-    default:
-        break;
+    if (version > machine->getOsVersionNumber()) {
+        emit updateAvailable(availableUpdate.version);
+        return;
     }
+
+    emit alreadyUpToDate();
 }
 
 void Updater::check(const QString &updateChannel)
@@ -212,9 +341,17 @@ void Updater::check(const QString &updateChannel)
     request.setMaximumRedirectsAllowed(1);
     request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
 
+    manifestCache.load(url);
+    manifestCache.addConditionalHeaders(&request);
+
     if (pendingReply)
         pendingReply->abort();
 
+    abortVerification();
+
+    checkTimer.start();
+    stateTimer.start();
+
     state = Updater::StateDownloadJson;
     networkAccessManager.setNetworkAccessible(QNetworkAccessManager::Accessible);
     pendingReply = networkAccessManager.get(request);
@@ -259,46 +396,76 @@ bool Updater::install()
 // VCDIFF delta images and full images) and verifies the written output.
 // Its main entry point is an 'AvailableUpdate' where it gets its URLs and SHA512
 // sums from. It emits signals for success, failure and progress updates.
+// Boot image and rootfs are installed concurrently, sharing the I/O throttler
+// and the download connections.
 //
 
 UpdateThread::UpdateThread(const Updater *updater, unsigned throttleUsecPerKb, QObject *parent) :
     QThread(parent),
     updater(updater),
     lastEmittedProgress(-1),
-    throttleDelay(throttleUsecPerKb)
+    activeInstalls(0),
+    aborted(0),
+    dirtyLimit(UpdateThread::defaultDirtyLimit),
+    throttler(throttleUsecPerKb)
 {
 }
 
+void UpdateThread::Install::run()
+{
+    updateThread->currentImage.setLocalData(image);
+    ret = func();
+
+    if (!ret)
+        updateThread->aborted.storeRelease(1);
+
+    updateThread->activeInstalls.deref();
+}
+
+int UpdateThread::connectionShare() const
+{
+    // Concurrent installs split the connections evenly, so a chunked rootfs
+    // download doesn't starve the boot image of bandwidth. The share is taken
+    // when a chunked or block-wise download starts and kept until it ends;
+    // connections an install frees up later are not handed to a download
+    // that is already running. Delta, compressed and single stream full
+    // image downloads use one connection regardless.
+    int installs = qMax(1, activeInstalls.load());
+
+    return qMax(1, UpdateThread::downloadConnections / installs);
+}
+
 void UpdateThread::emitProgress(bool isDownload, double v)
 {
     //
-    // segment the progress indicator into 4 parts:
-    //
-    // 25% for boot image download
-    // 25% for boot image verification
-    // 25% for rootfs download
-    // 25% for rootfs verification
+    // Download and verification each account for half of an image's progress.
+    // Images are weighted by their size, so the overall progress advances at
+    // a steady rate while both are installed concurrently.
     //
 
     if (v < 0.0f || v > 1.0f)
         return;
 
-    double p = 0.0f;
+    QMutexLocker locker(&progressMutex);
 
-    switch (state) {
-    case UpdateThread::DownloadBootimgState:
-        break;
+    if (!currentImage.hasLocalData() || currentImage.localData() >= imageProgress.size())
+        return;
 
-    case UpdateThread::DownloadRootfsState:
-        p += 0.5;
-        break;
-    }
+    ImageProgress &current = imageProgress[currentImage.localData()];
+
+    if (isDownload)
+        current.download = v;
+    else
+        current.verify = v;
 
-    if (!isDownload)
-        p += 0.25;
+    double done = 0.0f, total = 0.0f;
 
-    p += v/4;
-    p = round(p * 100) / 100;
+    foreach (const ImageProgress &image, imageProgress) {
+        done += image.weight * (image.download + image.verify) / 2;
+        total += image.weight;
+    }
+
+    double p = round(done / total * 100) / 100;
 
     if (p != lastEmittedProgress)
         emit progress(p);
@@ -309,12 +476,18 @@ void UpdateThread::emitProgress(bool isDownload, double v)
 bool UpdateThread::downloadDeltaImage(ImageReader::ImageType type,
                                       const QUrl &deltaUrl,
                                       const QString &dictionaryPath,
-                                      const QString &outputPath)
+                                      const QString &outputPath,
+                                      QByteArray *digest,
+                                      qint64 *length,
+                                      int step,
+                                      int steps)
 {
     QEventLoop loop;
     QTimer timer;
     bool ret = false;
     bool error = false;
+    bool targetTouched = false;
+    qint64 prefetched = 0;
 
     qInfo(UpdaterLog) << "Downloading delta update from" << deltaUrl;
 
@@ -333,30 +506,50 @@ bool UpdateThread::downloadDeltaImage(ImageReader::ImageType type,
     if (!dict.open())
         return false;
 
+    // Copies from the dictionary roughly follow the target position, as
+    // both images share most of their layout. Instead of letting the decoder
+    // fault the dictionary in page by page, read a window ahead of the
+    // decoder's output position into the page cache.
     const char *buf = (const char *) dict.map();
     if (buf == nullptr)
         return false;
 
+    dict.prefetch(0, UpdateThread::dictionaryWindow);
+    prefetched = UpdateThread::dictionaryWindow;
+
     QNetworkReply *reply = networkAccessManager.get(request);
     reply->setReadBufferSize(1024 * 1024);
 
     // We need to move these objects to the thread we're running in. Otherwise, the handler for the reply signals
     // will fire in the main thread, leading to memory corruption in reply->readAll()
-    networkAccessManager.moveToThread(thread());
-    reply->moveToThread(thread());
+    networkAccessManager.moveToThread(QThread::currentThread());
+    reply->moveToThread(QThread::currentThread());
+
+    // Target bytes are written and hashed as the decoder emits them, so the
+    // image can be verified the moment decoding finishes. Dirty pages of the
+    // target are capped rather than mapping the whole partition.
+    VCDiffHashingOutput decoderOutput(&output, output.maxSize(), dirtyLimit);
 
     open_vcdiff::VCDiffStreamingDecoder decoder;
     decoder.SetMaximumTargetFileSize(output.maxSize());
-    decoder.SetThrottleTime(throttleDelay);
-    decoder.StartDecoding(buf, dict.size(), output.map(), output.maxSize());
+    decoder.SetAllowVcdTarget(false);
+    decoder.SetThrottleTime(throttler.usecPerKb());
+    decoder.StartDecoding(buf, dict.size());
 
-    QObject::connect(reply, &QNetworkReply::readyRead, [this, &loop, &decoder, &error, &reply]() {
+    QObject::connect(reply, &QNetworkReply::readyRead, [this, &loop, &decoder, &decoderOutput, &error, &reply,
+                                                        &output, &targetTouched, &dict, &prefetched]() {
         if (reply->error() != QNetworkReply::NoError) {
             qInfo(UpdaterLog) << "Error downloading file: " << reply->errorString();
             error = true;
             return;
         }
 
+        if (abortRequested()) {
+            error = true;
+            loop.quit();
+            return;
+        }
+
         QVariant status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
         if (status.toInt() == 404) {
             qInfo(UpdaterLog) << "Error 404 downloading file";
@@ -364,10 +557,27 @@ bool UpdateThread::downloadDeltaImage(ImageReader::ImageType type,
             return;
         }
 
+        // The decoder is about to write to the target, which invalidates any
+        // partial full image download recorded for it.
+        if (!targetTouched) {
+            DownloadJournal::invalidate(output.fileName());
+            targetTouched = true;
+        }
+
+        decoder.SetThrottleTime(throttler.usecPerKb());
+
         const QByteArray data = reply->readAll();
-        if (!decoder.DecodeChunkToInterface(data.constData(), data.size())) {
+        if (!decoder.DecodeChunkToInterface(data.constData(), data.size(), &decoderOutput) ||
+            decoderOutput.failed()) {
             error = true;
             loop.quit();
+            return;
+        }
+
+        qint64 ahead = decoderOutput.highWaterMark() + UpdateThread::dictionaryWindow;
+        if (ahead - prefetched >= UpdateThread::dictionaryWindow / 2 && prefetched < dict.size()) {
+            dict.prefetch(prefetched, ahead - prefetched);
+            prefetched = ahead;
         }
     });
 
@@ -381,15 +591,15 @@ bool UpdateThread::downloadDeltaImage(ImageReader::ImageType type,
     });
 
     QObject::connect(reply, &QNetworkReply::finished, [this, &loop, &decoder, &ret, &error]() {
-        if (!error)
-            decoder.FinishDecoding();
+        if (!error && !decoder.FinishDecoding())
+            error = true;
 
         ret = true;
         loop.quit();
     });
 
-    QObject::connect(reply, &QNetworkReply::downloadProgress, [this](qint64 bytesReceived, qint64 bytesTotal) {
-        emitProgress(true, (float) bytesReceived / (float) bytesTotal);
+    QObject::connect(reply, &QNetworkReply::downloadProgress, [this, step, steps](qint64 bytesReceived, qint64 bytesTotal) {
+        emitProgress(true, (step + (float) bytesReceived / (float) bytesTotal) / steps);
     });
 
     QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
@@ -399,14 +609,159 @@ bool UpdateThread::downloadDeltaImage(ImageReader::ImageType type,
 
     reply->deleteLater();
 
-    return ret && !error;
+    // The dictionary pages were only needed for this decode
+    dict.dropCache();
+
+    if (!ret || error || decoderOutput.failed() || !output.sync())
+        return false;
+
+    *digest = decoderOutput.result();
+    *length = decoderOutput.highWaterMark();
+
+    return true;
+}
+
+bool UpdateThread::downloadDeltaChain(ImageReader::ImageType type,
+                                      const QList<Delta> &route,
+                                      const QString &seedPath,
+                                      const QString &outputPath,
+                                      QByteArray *digest,
+                                      qint64 *length)
+{
+    BlockDevice target(outputPath);
+    if (!target.open())
+        return false;
+
+    qint64 capacity = target.maxSize();
+    target.close();
+
+    // Steps alternate between the target partition and a memory file, such
+    // that the last one lands on the target. Each step uses the output of the
+    // previous one as its dictionary, so at most one intermediate image is
+    // kept in memory.
+    QString dictionaryPath = seedPath;
+    QString memoryFile;
+    bool ret = true;
+
+    for (int i = 0; i < route.size() && ret; i++) {
+        bool toTarget = (route.size() - 1 - i) % 2 == 0;
+
+        if (!toTarget && memoryFile.isEmpty()) {
+            memoryFile = BlockDevice::createMemoryFile("kalami-delta", capacity);
+            if (memoryFile.isEmpty())
+                return false;
+        }
+
+        QString stepOutput = toTarget ? outputPath : memoryFile;
+
+        qInfo(UpdaterLog) << "Applying delta" << i + 1 << "of" << route.size() << "from"
+                          << route[i].from << "to" << route[i].to;
+
+        ret = downloadDeltaImage(type, route[i].url, dictionaryPath, stepOutput, digest, length, i, route.size());
+        dictionaryPath = stepOutput;
+    }
+
+    if (!memoryFile.isEmpty())
+        BlockDevice::releaseMemoryFile(memoryFile);
+
+    return ret;
 }
 
-bool UpdateThread::downloadFullImage(const QUrl &url, const QString &outputPath)
+// Client errors other than timeouts and rate limiting won't go away by asking
+// again. A range the server can't satisfy is retried from the start.
+static bool retryableStatus(int status)
+{
+    if (status < 400 || status >= 500)
+        return true;
+
+    return status == 408 || status == 416 || status == 429;
+}
+
+bool UpdateThread::downloadFullImage(const QUrl &url, const QString &outputPath, const QString &sha512,
+                                     QByteArray *digest, qint64 *length)
+{
+    DownloadJournal journal(url, outputPath, sha512);
+    int retries = 0;
+
+    // Interrupted downloads are continued from the last checkpoint in the journal.
+    // Give up only if several attempts in a row didn't make any progress, or
+    // the server refused the request for good.
+    while (!abortRequested()) {
+        qint64 offset = journal.load() ? journal.offset() : 0;
+        bool retryable = true;
+
+        if (fetchFullImage(url, outputPath, &journal, digest, length, NULL, &retryable)) {
+            journal.clear();
+            return true;
+        }
+
+        if (!retryable)
+            break;
+
+        if (journal.offset() > offset)
+            retries = 0;
+        else if (++retries >= UpdateThread::maxDownloadRetries)
+            break;
+
+        qInfo(UpdaterLog) << "Download of" << url << "interrupted at offset" << journal.offset()
+                          << ", retrying";
+        QThread::sleep(5);
+    }
+
+    journal.clear();
+
+    return false;
+}
+
+bool UpdateThread::fetchFullImage(const QUrl &url, const QString &outputPath, DownloadJournal *journal,
+                                  QByteArray *digest, qint64 *length, const CompressedManifest *compressed,
+                                  bool *retryable)
 {
     QEventLoop loop;
     QTimer timer;
     bool ret = false;
+    bool restart = false;
+    bool statusChecked = false;
+
+    // Bypass the page cache, so writing hundreds of MB doesn't evict what the
+    // running system needs.
+    BlockDevice output(outputPath);
+    if (!output.open(QFile::ReadWrite, BlockDevice::DirectIO | BlockDevice::AsyncIO))
+        return false;
+
+    // Network receive, block device writes and hashing run in separate stages,
+    // so the image can be verified without reading it back from the device.
+    ImagePipeline pipeline(&output);
+    pipeline.setThrottler(&throttler);
+
+    // Compressed images are decompressed straight into the pipeline. Their
+    // offsets don't map to the image, so they can't be resumed.
+    QScopedPointer<StreamInflater> inflater;
+
+    if (compressed) {
+        if (compressed->length > output.maxSize()) {
+            qInfo(UpdaterLog) << "Compressed image of" << compressed->length << "bytes does not fit" << outputPath;
+            return false;
+        }
+
+        inflater.reset(new StreamInflater(compressed->codec, compressed->length, [&pipeline](const char *data, qint64 length) {
+            return pipeline.push(data, length);
+        }));
+
+        if (!inflater->isValid())
+            return false;
+    }
+
+    qint64 resumeOffset = journal ? journal->offset() : 0;
+    if (resumeOffset > 0 && !pipeline.start(resumeOffset, journal->hashState())) {
+        journal->clear();
+        resumeOffset = 0;
+    }
+
+    if (resumeOffset == 0 && !pipeline.start())
+        return false;
+
+    qint64 lastCheckpoint = resumeOffset;
 
     QNetworkAccessManager networkAccessManager;
     networkAccessManager.setNetworkAccessible(QNetworkAccessManager::Accessible);
@@ -415,29 +770,65 @@ bool UpdateThread::downloadFullImage(const QUrl &url, const QString &outputPath)
     request.setAttribute(QNetworkRequest::SpdyAllowedAttribute, true);
     request.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, true);
 
+    if (resumeOffset > 0)
+        request.setRawHeader("Range", "bytes=" + QByteArray::number(resumeOffset) + "-");
+
     QNetworkReply *reply = networkAccessManager.get(request);
-    reply->setReadBufferSize(32 * 1024);
+    reply->setReadBufferSize(1024 * 1024);
 
     // We need to move these objects to the thread we're running in. Otherwise, the handler for the reply signals
     // will fire in the main thread, leading to memory corruption in reply->readAll()
-    networkAccessManager.moveToThread(thread());
-    reply->moveToThread(thread());
-
-    BlockDevice output(outputPath);
-    if (!output.open(QFile::ReadWrite))
-        return false;
-
-    qInfo(UpdaterLog) << "Downloading full image from" << url;
-
-    QObject::connect(reply, &QNetworkReply::readyRead, [this, &output, &reply]() {
+    networkAccessManager.moveToThread(QThread::currentThread());
+    reply->moveToThread(QThread::currentThread());
+
+    if (resumeOffset > 0)
+        qInfo(UpdaterLog) << "Resuming full image download from" << url << "at offset" << resumeOffset;
+    else if (compressed)
+        qInfo(UpdaterLog) << "Downloading" << compressed->codec << "compressed full image from" << url;
+    else
+        qInfo(UpdaterLog) << "Downloading full image from" << url;
+
+    QObject::connect(reply, &QNetworkReply::readyRead, [this, &pipeline, &inflater, &reply, &journal, &restart,
+                                                        &statusChecked, &lastCheckpoint, resumeOffset]() {
         if (reply->error() != QNetworkReply::NoError) {
             qInfo(UpdaterLog) << "Error downloading file: " << reply->error();
             reply->abort();
             return;
         }
 
+        if (abortRequested()) {
+            reply->abort();
+            return;
+        }
+
+        if (!statusChecked) {
+            int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+            if (resumeOffset > 0 && status != 206) {
+                qInfo(UpdaterLog) << "Server did not honor range request, status" << status;
+                restart = true;
+                reply->abort();
+                return;
+            }
+
+            statusChecked = true;
+        }
+
         const QByteArray data = reply->readAll();
-        output.write(data.constData(), data.size());
+        bool pushed = inflater ? inflater->inflate(data.constData(), data.size()) :
+                                 pipeline.push(data.constData(), data.size());
+        if (!pushed) {
+            reply->abort();
+            return;
+        }
+
+        if (journal && pipeline.bytesProcessed() - lastCheckpoint >= UpdateThread::checkpointInterval) {
+            qint64 offset;
+            QByteArray hashState;
+
+            if (pipeline.checkpoint(&offset, &hashState) && journal->checkpoint(offset, hashState))
+                lastCheckpoint = offset;
+        }
     });
 
     connect(reply, static_cast<void(QNetworkReply::*)(QNetworkReply::NetworkError)>(&QNetworkReply::error),
@@ -449,13 +840,13 @@ bool UpdateThread::downloadFullImage(const QUrl &url, const QString &outputPath)
         loop.quit();
     });
 
-    QObject::connect(reply, &QNetworkReply::finished, [this, &loop, &ret]() {
-        ret = true;
+    QObject::connect(reply, &QNetworkReply::finished, [this, &loop, &ret, &reply, &restart]() {
+        ret = reply->error() == QNetworkReply::NoError && !restart;
         loop.quit();
     });
 
-    QObject::connect(reply, &QNetworkReply::downloadProgress, [this](qint64 bytesReceived, qint64 bytesTotal) {
-        emitProgress(true, (float) bytesReceived / (float) bytesTotal);
+    QObject::connect(reply, &QNetworkReply::downloadProgress, [this, resumeOffset](qint64 bytesReceived, qint64 bytesTotal) {
+        emitProgress(true, (float) (resumeOffset + bytesReceived) / (float) (resumeOffset + bytesTotal));
     });
 
     QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
@@ -464,34 +855,249 @@ bool UpdateThread::downloadFullImage(const QUrl &url, const QString &outputPath)
 
     loop.exec();
 
+    if (reply->isRunning())
+        reply->abort();
+
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     reply->deleteLater();
 
-    return ret;
+    if (status == 416)
+        restart = true;
+
+    if (!ret && retryable && !retryableStatus(status)) {
+        qInfo(UpdaterLog) << "Server refused" << url << "with status" << status;
+        *retryable = false;
+    }
+
+    if (!ret) {
+        qint64 offset;
+        QByteArray hashState;
+
+        // Save whatever made it to the device, so the next attempt can continue from there
+        if (journal && restart)
+            journal->clear();
+        else if (journal && pipeline.checkpoint(&offset, &hashState) && offset > lastCheckpoint)
+            journal->checkpoint(offset, hashState);
+
+        pipeline.abort();
+        return false;
+    }
+
+    if (inflater && !inflater->finished()) {
+        qInfo(UpdaterLog) << "Compressed image from" << url << "is truncated";
+        pipeline.abort();
+        return false;
+    }
+
+    if (!pipeline.finish())
+        return false;
+
+    *digest = pipeline.result();
+    *length = pipeline.bytesProcessed();
+
+    return true;
 }
 
-bool UpdateThread::verifyImage(ImageReader::ImageType type, const QString &path, const QString &sha512)
+bool UpdateThread::downloadBlockImage(ImageReader::ImageType type, const QUrl &url, const BlockManifest &blocks,
+                                      const QString &seedPath, const QString &outputPath)
 {
-    QCryptographicHash hash(QCryptographicHash::Sha512);
+    ImageReader seed(type, seedPath);
+    if (!seed.open())
+        return false;
+
+    BlockDevice output(outputPath);
+    if (!output.open(QFile::ReadWrite))
+        return false;
+
+    qInfo(UpdaterLog) << "Updating" << outputPath << "block-wise from" << url;
+
+    DownloadJournal::invalidate(outputPath);
 
+    BlockUpdater updater(url, blocks, &seed, seed.size(), &output, connectionShare());
+
+    QObject::connect(&updater, &BlockUpdater::progress, [this](qint64 bytesReceived, qint64 bytesTotal) {
+        emitProgress(true, (float) bytesReceived / (float) bytesTotal);
+    });
+
+    return updater.update();
+}
+
+bool UpdateThread::downloadChunkedImage(const QUrl &url, const QString &outputPath, const ChunkManifest &chunks)
+{
+    BlockDevice output(outputPath);
+    if (!output.open(QFile::ReadWrite))
+        return false;
+
+    DownloadJournal::invalidate(outputPath);
+
+    ChunkedDownloader downloader(url, &output, chunks, connectionShare());
+
+    QObject::connect(&downloader, &ChunkedDownloader::progress, [this, &downloader](qint64 bytesReceived, qint64 bytesTotal) {
+        if (abortRequested())
+            downloader.abort();
+
+        emitProgress(true, (float) bytesReceived / (float) bytesTotal);
+    });
+
+    return downloader.download();
+}
+
+bool UpdateThread::verifyChunkedImage(ImageReader::ImageType type, const QString &path,
+                                      const ChunkManifest &chunks, const QString &sha512,
+                                      const TreeManifest &tree)
+{
+    // Every chunk was checked against the signed manifest already, but that
+    // doesn't prove the chunks add up to the published image. The image is
+    // read back and checked against its tree hash, or its flat SHA512 if
+    // there is no tree manifest.
+    qInfo(UpdaterLog) << "All" << chunks.sha512.size() << "chunks of" << path << "matched their checksums";
+
+    return verifyImage(type, path, sha512, tree);
+}
+
+bool UpdateThread::verifyStreamedImage(ImageReader::ImageType type, const QString &path,
+                                       const QByteArray &digest, qint64 length, const QString &sha512,
+                                       const TreeManifest &tree)
+{
     ImageReader image(type, path);
     if (!image.open())
         return false;
 
-    qint64 pos = 0;
-    const char *buf = (const char *) image.map();
-    if (!buf)
+    // The streamed digest covers exactly what was downloaded. If that doesn't
+    // match the image size the header reports, hash the image from the device.
+    if (length != image.size()) {
+        qInfo(UpdaterLog) << "Downloaded" << length << "bytes, but image size is" << image.size()
+                          << "- falling back to full verification";
+        image.close();
+        return verifyImage(type, path, sha512, tree);
+    }
+
+    emitProgress(false, 1.0);
+
+    if (digest.toHex() == sha512) {
+        qInfo(UpdaterLog) << "Image verification for" << path
+                          << "succeeded: " << sha512;
+        return true;
+    }
+
+    qInfo(UpdaterLog) << "Image verification for" << path << "failed."
+                      << digest.toHex() << "!=" << sha512;
+    return false;
+}
+
+bool UpdateThread::verifyTreeImage(ImageReader *image, const TreeManifest &tree)
+{
+    TreeVerifier verifier(image, tree, &throttler);
+
+    QObject::connect(&verifier, &TreeVerifier::progress, [this](qint64 bytesDone, qint64 bytesTotal) {
+        emitProgress(false, (double) bytesDone / (double) bytesTotal);
+    });
+
+    bool ok = verifier.verify();
+
+    image->dropCache();
+
+    if (ok)
+        qInfo(UpdaterLog) << "Image verification for" << image->fileName()
+                          << "succeeded through tree hash" << tree.root;
+    else
+        qInfo(UpdaterLog) << "Image verification for" << image->fileName() << "failed.";
+
+    return ok;
+}
+
+bool UpdateThread::verifyImage(ImageReader::ImageType type, const QString &path, const QString &sha512,
+                               const TreeManifest &tree)
+{
+    Sha512 hash;
+
+    ImageReader image(type, path);
+    if (!image.open(BlockDevice::AsyncIO))
         return false;
 
-    while (pos < image.size()) {
-        qint64 l = qMin((qint64) 1024 * 1024, (qint64) (image.size() - pos));
-        hash.addData(buf, l);
-        pos += l;
-        buf += l;
-        QThread::usleep(throttleDelay * 1024);
+    // Leaves of a tree hash can be computed on all cores in parallel
+    if (tree.isValid()) {
+        if (tree.length == image.size())
+            return verifyTreeImage(&image, tree);
+
+        qInfo(UpdaterLog) << "Tree hash covers" << tree.length << "bytes, but image size is" << image.size()
+                          << "- falling back to flat verification";
+    }
+
+    image.advise(BlockDevice::SequentialAccess);
+
+    // Keep several reads in flight, and hash the buffers in order as they
+    // complete.
+    QVector<char *> buffers;
+    QVector<qint64> lengths(UpdateThread::verifyDepth);
+    QVector<qint64> results(UpdateThread::verifyDepth);
+
+    for (int i = 0; i < UpdateThread::verifyDepth; i++)
+        buffers.append(BlockDevice::allocateBuffer(UpdateThread::verifyBufferSize));
+
+    quint64 queued = 0, hashed = 0;
+    qint64 queuedPos = 0, pos = 0;
+    bool ok = !buffers.contains(NULL);
+
+    while (ok && pos < image.size()) {
+        if (abortRequested()) {
+            ok = false;
+            break;
+        }
+
+        while (queued - hashed < (quint64) UpdateThread::verifyDepth && queuedPos < image.size()) {
+            int i = queued % UpdateThread::verifyDepth;
+
+            lengths[i] = qMin(UpdateThread::verifyBufferSize, image.size() - queuedPos);
+            results[i] = -2;
+
+            if (!image.queueRead(buffers[i], lengths[i], queuedPos, queued)) {
+                ok = false;
+                break;
+            }
+
+            queuedPos += lengths[i];
+            queued++;
+        }
+
+        if (!ok || !image.submit())
+            break;
+
+        int i = hashed % UpdateThread::verifyDepth;
+
+        while (ok && results[i] == -2) {
+            quint64 tag;
+            qint64 result;
+
+            ok = image.waitCompletion(&tag, &result);
+            if (ok)
+                results[tag % UpdateThread::verifyDepth] = result;
+        }
+
+        if (!ok || results[i] != lengths[i]) {
+            qWarning(UpdaterLog) << "Unable to read" << path << "at offset" << pos;
+            ok = false;
+            break;
+        }
+
+        hash.addData(buffers[i], lengths[i]);
+        pos += lengths[i];
+        hashed++;
+        throttler.throttle(lengths[i]);
 
         emitProgress(false, (float) pos / (float) image.size());
     }
 
+    // Closing waits for outstanding reads, so the buffers can be released
+    image.dropCache();
+    image.close();
+
+    for (int i = 0; i < buffers.size(); i++)
+        BlockDevice::freeBuffer(buffers[i]);
+
+    if (!ok)
+        return false;
+
     if (hash.result().toHex() == sha512) {
         qInfo(UpdaterLog) << "Image verification for" << path
                           << "succeeded: " << sha512;
@@ -503,25 +1109,105 @@ bool UpdateThread::verifyImage(ImageReader::ImageType type, const QString &path,
     return false;
 }
 
+static qint64 imageWeight(const ChunkManifest &chunks, const BlockManifest &blocks, const TreeManifest &tree)
+{
+    if (tree.isValid())
+        return tree.length;
+
+    if (chunks.isValid())
+        return chunks.length;
+
+    if (blocks.isValid())
+        return blocks.length;
+
+    return 0;
+}
+
+static qint64 availableMemory()
+{
+    QFile meminfo("/proc/meminfo");
+
+    if (!meminfo.open(QFile::ReadOnly))
+        return 0;
+
+    // MemAvailable:    1234567 kB
+    forever {
+        QByteArray line = meminfo.readLine();
+        if (line.isEmpty())
+            return 0;
+
+        if (line.startsWith("MemAvailable:"))
+            return line.mid(13).trimmed().split(' ').first().toLongLong() * 1024;
+    }
+}
+
 bool UpdateThread::downloadAndVerify(ImageReader::ImageType type,
                                      const QString &dictionaryPath,
                                      const QString &outputPath,
                                      const QUrl &fullImageUrl,
-                                     const QUrl &deltaImageUrl,
-                                     const QString &sha512)
+                                     const QList<Delta> &deltas,
+                                     const QString &sha512,
+                                     const ChunkManifest &chunks,
+                                     const BlockManifest &blocks,
+                                     const TreeManifest &tree,
+                                     const CompressedManifest &compressed)
 {
     qInfo(UpdaterLog) << "Installing update to" << outputPath
                       << "using" << dictionaryPath << "as update seed";
 
-    if (downloadDeltaImage(type, deltaImageUrl, dictionaryPath, outputPath) &&
-        verifyImage(type, outputPath, sha512))
+    QByteArray digest;
+    qint64 length = 0;
+
+    // If a previous full image download was interrupted, continue it rather than
+    // overwriting the partially written image with the delta.
+    DownloadJournal journal(fullImageUrl, outputPath, sha512);
+    bool resumeFullImage = journal.load();
+
+    // With a block map, only blocks that can't be found locally are downloaded
+    // and written.
+    if (!abortRequested() && !resumeFullImage && blocks.isValid() &&
+        downloadBlockImage(type, fullImageUrl, blocks, dictionaryPath, outputPath) &&
+        verifyImage(type, outputPath, sha512, tree))
         return true;
 
-    // Downloading the delta didn't succeed, so let's try the full file
-    if (downloadFullImage(fullImageUrl, outputPath) &&
-        verifyImage(type, outputPath, sha512))
+    // Devices that skipped builds may get there through a chain of deltas, if
+    // that's cheaper than the full image. As boot image and rootfs are installed
+    // at the same time, an intermediate image may take a quarter of the
+    // available memory.
+    const AvailableUpdate *update = updater->getAvailableUpdate();
+    DeltaPlanner planner(deltas, imageWeight(chunks, blocks, tree), availableMemory() / 4);
+    QList<Delta> route = resumeFullImage ? QList<Delta>() : planner.plan(update->currentVersion, update->version);
+
+    if (!abortRequested() && !route.isEmpty() &&
+        downloadDeltaChain(type, route, dictionaryPath, outputPath, &digest, &length) &&
+        verifyStreamedImage(type, outputPath, digest, length, sha512, tree))
+        return true;
+
+    // Applying deltas didn't succeed, so let's try the full file. A compressed
+    // one saves most of the transfer, but can't be resumed. If it gets
+    // interrupted, the uncompressed image is fetched below.
+    if (!abortRequested() && !resumeFullImage && compressed.isValid() && StreamInflater::supports(compressed.codec) &&
+        fetchFullImage(compressed.url, outputPath, NULL, &digest, &length, &compressed) &&
+        verifyStreamedImage(type, outputPath, digest, length, sha512, tree))
+        return true;
+
+    // Fetch the uncompressed image in parallel chunks if the server published
+    // a chunk manifest for it.
+    if (!abortRequested() && !resumeFullImage && chunks.isValid() &&
+        downloadChunkedImage(fullImageUrl, outputPath, chunks) &&
+        verifyChunkedImage(type, outputPath, chunks, sha512, tree))
         return true;
 
+    if (!abortRequested() &&
+        downloadFullImage(fullImageUrl, outputPath, sha512, &digest, &length) &&
+        verifyStreamedImage(type, outputPath, digest, length, sha512, tree))
+        return true;
+
+    if (abortRequested()) {
+        qInfo(UpdaterLog) << "Installation of the other image failed, giving up on" << outputPath;
+        return false;
+    }
+
     // Everything failed. We're bricked.
     qInfo(UpdaterLog) << "Full image update failed as well.";
 
@@ -531,28 +1217,55 @@ bool UpdateThread::downloadAndVerify(ImageReader::ImageType type,
 void UpdateThread::run()
 {
     const AvailableUpdate *update = updater->getAvailableUpdate();
-    bool ret;
 
     QThread::currentThread()->setPriority(QThread::LowestPriority);
 
-    state = UpdateThread::DownloadBootimgState;
-    ret = downloadAndVerify(ImageReader::AndroidBootType,
-                            updater->getUpdateSeed(Updater::BootImageType),
-                            updater->getUpdateTarget(Updater::BootImageType),
-                            update->bootimgUrl, update->bootimgDeltaUrl,
-                            update->bootimgSha512);
-    if (!ret) {
-        emit failed();
-        return;
-    }
+    // Both images go to different partitions from different URLs, so they are
+    // installed concurrently. Without sizes from the manifests, they count
+    // equally towards the overall progress.
+    qint64 bootWeight = imageWeight(update->bootimgChunks, update->bootimgBlocks, update->bootimgTree);
+    qint64 rootfsWeight = imageWeight(update->rootfsChunks, update->rootfsBlocks, update->rootfsTree);
+
+    if (bootWeight == 0 || rootfsWeight == 0)
+        bootWeight = rootfsWeight = 1;
+
+    imageProgress.clear();
+    imageProgress.append({ bootWeight, 0.0, 0.0 });
+    imageProgress.append({ rootfsWeight, 0.0, 0.0 });
+    lastEmittedProgress = -1;
+
+    Install boot(this, 0, [this, update]() {
+        return downloadAndVerify(ImageReader::AndroidBootType,
+                                 updater->getUpdateSeed(Updater::BootImageType),
+                                 updater->getUpdateTarget(Updater::BootImageType),
+                                 update->bootimgUrl, update->bootimgDeltas,
+                                 update->bootimgSha512, update->bootimgChunks,
+                                 update->bootimgBlocks, update->bootimgTree,
+                                 update->bootimgCompressed);
+    });
 
-    state = UpdateThread::DownloadRootfsState;
-    ret = downloadAndVerify(ImageReader::SquashFsType,
-                            updater->getUpdateSeed(Updater::RootfsImageType),
-                            updater->getUpdateTarget(Updater::RootfsImageType),
-                            update->rootfsUrl, update->rootfsDeltaUrl,
-                            update->rootfsSha512);
-    if (!ret) {
+    Install rootfs(this, 1, [this, update]() {
+        return downloadAndVerify(ImageReader::SquashFsType,
+                                 updater->getUpdateSeed(Updater::RootfsImageType),
+                                 updater->getUpdateTarget(Updater::RootfsImageType),
+                                 update->rootfsUrl, update->rootfsDeltas,
+                                 update->rootfsSha512, update->rootfsChunks,
+                                 update->rootfsBlocks, update->rootfsTree,
+                                 update->rootfsCompressed);
+    });
+
+    activeInstalls.store(2);
+    aborted.store(0);
+    boot.start(QThread::LowestPriority);
+    rootfs.start(QThread::LowestPriority);
+
+    boot.wait();
+    rootfs.wait();
+
+    if (!boot.succeeded() || !rootfs.succeeded()) {
+        qInfo(UpdaterLog) << "Installation failed:"
+                          << "boot image" << (boot.succeeded() ? "succeeded" : "failed") << ","
+                          << "rootfs" << (rootfs.succeeded() ? "succeeded" : "failed");
         emit failed();
         return;
     }
@@ -4,13 +4,28 @@
 #include <QObject>
 #include <QNetworkAccessManager>
 #include <QThread>
+#include <QThreadStorage>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QVector>
 #include <QFile>
+#include <QProcess>
+#include <QElapsedTimer>
 #include <QtCore/QLoggingCategory>
 
+#include <functional>
+
 #include <google/vcdecoder.h>
 
 #include "machine.h"
 #include "imagereader.h"
+#include "chunkeddownloader.h"
+#include "blockupdater.h"
+#include "iothrottler.h"
+#include "treeverifier.h"
+#include "manifestcache.h"
+#include "deltaplanner.h"
+#include "streaminflater.h"
 
 Q_DECLARE_LOGGING_CATEGORY(UpdaterLog)
 
@@ -20,11 +35,21 @@ struct AvailableUpdate {
     QString rootfsSha512;
     QUrl bootimgUrl;
     QString bootimgSha512;
-    QUrl rootfsDeltaUrl;
-    QUrl bootimgDeltaUrl;
+    QString currentVersion;
+    QList<Delta> rootfsDeltas;
+    QList<Delta> bootimgDeltas;
+    ChunkManifest rootfsChunks;
+    ChunkManifest bootimgChunks;
+    BlockManifest rootfsBlocks;
+    BlockManifest bootimgBlocks;
+    TreeManifest rootfsTree;
+    TreeManifest bootimgTree;
+    CompressedManifest rootfsCompressed;
+    CompressedManifest bootimgCompressed;
 };
 
 class UpdateThread;
+class DownloadJournal;
 
 class Updater : public QObject
 {
@@ -63,17 +88,34 @@ public slots:
     bool install();
 
 private slots:
-    bool verifySignature(const QString &contentFile, const QString &signatureFile);
     void downloadFinished();
+    void signatureVerified(bool valid);
 
 private:
+    // Event loop time a single step of the check may take before it's reported
+    static const qint64 maxStepMs = 5;
+
     enum State state;
     const Machine *machine;
     QNetworkAccessManager networkAccessManager;
     QNetworkReply *pendingReply;
+    QProcess *gpg;
+    QByteArray manifest;
+    QByteArray manifestSignature;
+    QByteArray manifestETag;
+    QByteArray manifestLastModified;
+    ManifestCache manifestCache;
+    bool nativeSignature;
+    QElapsedTimer checkTimer;
+    QElapsedTimer stateTimer;
     struct AvailableUpdate availableUpdate;
     QString installedUpdateVersion;
     UpdateThread *thread;
+
+    void verifySignature(const QByteArray &content, const QByteArray &signature);
+    void abortVerification();
+    void reportStep(const char *step);
+    void evaluateUpdate();
 };
 
 class UpdateThread : public QThread
@@ -83,6 +125,9 @@ class UpdateThread : public QThread
 public:
     UpdateThread(const Updater *updater, unsigned throttleUsecPerKb, QObject *parent = 0);
 
+    // Dirty page cache a delta decode may accumulate on the target
+    void setDirtyLimit(qint64 bytes) { dirtyLimit = bytes; }
+
 protected:
     virtual void run() Q_DECL_OVERRIDE;
 
@@ -92,20 +137,67 @@ signals:
     void failed();
 
 private:
+    friend class UpdateBenchmark;
+
+    static const int maxDownloadRetries = 5;
+    static const qint64 checkpointInterval = 16 * 1024 * 1024;
+    static const int downloadConnections = 4;
+    static const int verifyDepth = 4;
+    static const qint64 verifyBufferSize = 1024 * 1024;
+    static const qint64 dictionaryWindow = 8 * 1024 * 1024;
+    static const qint64 defaultDirtyLimit = 16 * 1024 * 1024;
+
+    // Boot image and rootfs are installed by one Install thread each. They
+    // share the I/O throttler and split the download connections between them.
+    // If one of them fails, the update can't succeed anymore, so the other one
+    // gives up at its next abort check.
+    class Install : public QThread
+    {
+    public:
+        Install(UpdateThread *updateThread, int image, std::function<bool()> func) :
+            updateThread(updateThread), image(image), func(func), ret(false) {}
+
+        bool succeeded() const { return ret; }
+
+    protected:
+        void run() Q_DECL_OVERRIDE;
+
+    private:
+        UpdateThread *updateThread;
+        int image;
+        std::function<bool()> func;
+        bool ret;
+    };
 
-    enum State {
-        DownloadBootimgState,
-        DownloadRootfsState,
+    // Progress of a single image, weighted by its size in the overall progress
+    struct ImageProgress {
+        qint64 weight;
+        double download;
+        double verify;
     };
 
-    enum State state;
     const Updater *updater;
+    QVector<ImageProgress> imageProgress;
+    QThreadStorage<int> currentImage;
+    QMutex progressMutex;
     double lastEmittedProgress;
-    unsigned int throttleDelay;
+    QAtomicInt activeInstalls;
+    QAtomicInt aborted;
+    qint64 dirtyLimit;
+    IoThrottler throttler;
+    int connectionShare() const;
+    bool abortRequested() const { return aborted.loadAcquire(); }
     void emitProgress(bool isDownload, double v);
-    bool downloadDeltaImage(ImageReader::ImageType type, const QUrl &deltaUrl, const QString &dictionaryPath, const QString &outputPath);
-    bool downloadFullImage(const QUrl &source, const QString &outputPath);
-    bool verifyImage(ImageReader::ImageType type, const QString &path, const QString &sha512);
-    bool downloadAndVerify(ImageReader::ImageType type, const QString &dictionaryPath, const QString &outputPath, const QUrl &fullImageUrl, const QUrl &deltaImageUrl, const QString &sha512);
+    bool downloadDeltaImage(ImageReader::ImageType type, const QUrl &deltaUrl, const QString &dictionaryPath, const QString &outputPath, QByteArray *digest, qint64 *length, int step = 0, int steps = 1);
+    bool downloadDeltaChain(ImageReader::ImageType type, const QList<Delta> &route, const QString &seedPath, const QString &outputPath, QByteArray *digest, qint64 *length);
+    bool downloadFullImage(const QUrl &source, const QString &outputPath, const QString &sha512, QByteArray *digest, qint64 *length);
+    bool fetchFullImage(const QUrl &source, const QString &outputPath, DownloadJournal *journal, QByteArray *digest, qint64 *length, const CompressedManifest *compressed = NULL, bool *retryable = NULL);
+    bool downloadBlockImage(ImageReader::ImageType type, const QUrl &source, const BlockManifest &blocks, const QString &seedPath, const QString &outputPath);
+    bool downloadChunkedImage(const QUrl &source, const QString &outputPath, const ChunkManifest &chunks);
+    bool verifyImage(ImageReader::ImageType type, const QString &path, const QString &sha512, const TreeManifest &tree);
+    bool verifyTreeImage(ImageReader *image, const TreeManifest &tree);
+    bool verifyStreamedImage(ImageReader::ImageType type, const QString &path, const QByteArray &digest, qint64 length, const QString &sha512, const TreeManifest &tree);
+    bool verifyChunkedImage(ImageReader::ImageType type, const QString &path, const ChunkManifest &chunks, const QString &sha512, const TreeManifest &tree);
+    bool downloadAndVerify(ImageReader::ImageType type, const QString &dictionaryPath, const QString &outputPath, const QUrl &fullImageUrl, const QList<Delta> &deltas, const QString &sha512, const ChunkManifest &chunks, const BlockManifest &blocks, const TreeManifest &tree, const CompressedManifest &compressed);
 };
 
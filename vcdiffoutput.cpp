@@ -0,0 +1,68 @@
+#include "vcdiffoutput.h"
+
+VCDiffHashingOutput::VCDiffHashingOutput(BlockDevice *target, qint64 capacity, qint64 dirtyLimit) :
+    target(target),
+    capacity(capacity),
+    dirtyLimit(dirtyLimit),
+    highWater(0),
+    writebackStarted(0),
+    writebackDone(0),
+    overflow(false),
+    writeError(false),
+    hash()
+{
+}
+
+VCDiffHashingOutput &VCDiffHashingOutput::append(const char *s, size_t n)
+{
+    if (overflow || highWater + (qint64) n > capacity) {
+        overflow = true;
+        return *this;
+    }
+
+    if (writeError || target->write(s, n) != (qint64) n) {
+        writeError = true;
+        return *this;
+    }
+
+    hash.addData(s, n);
+    highWater += n;
+
+    // At most two regions are dirty at a time: the one being written back,
+    // which was started a limit's worth of output ago and has most likely
+    // reached the device by now, and the one being filled.
+    if (dirtyLimit > 0 && highWater - writebackStarted >= dirtyLimit) {
+        if (writebackStarted > writebackDone &&
+            !target->writeback(writebackDone, writebackStarted - writebackDone, true))
+            writeError = true;
+
+        if (!target->writeback(writebackStarted, highWater - writebackStarted, false))
+            writeError = true;
+
+        writebackDone = writebackStarted;
+        writebackStarted = highWater;
+    }
+
+    return *this;
+}
+
+void VCDiffHashingOutput::clear()
+{
+    highWater = 0;
+    writebackStarted = 0;
+    writebackDone = 0;
+    overflow = false;
+    writeError = !target->seek(0);
+    hash.reset();
+}
+
+void VCDiffHashingOutput::push_back(char c)
+{
+    append(&c, 1);
+}
+
+void VCDiffHashingOutput::ReserveAdditionalBytes(size_t n)
+{
+    if (highWater + (qint64) n > capacity)
+        overflow = true;
+}
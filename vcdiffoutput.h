@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QByteArray>
+
+#include <google/output_string.h>
+
+#include "blockdevice.h"
+#include "sha512.h"
+
+//
+// VCDiffHashingOutput is an output interface for the VCDIFF streaming decoder
+// that writes decoded target bytes to a device and hashes them on the fly. As
+// the decoder emits the target strictly sequentially, the high-water mark
+// tells how much of the image the digest covers.
+//
+// Written data goes through the page cache. To bound the amount of dirty
+// memory, writeback is started whenever dirtyLimit bytes have accumulated,
+// and the region before that is waited for and dropped from the cache.
+//
+
+class VCDiffHashingOutput : public open_vcdiff::OutputStringInterface
+{
+public:
+    VCDiffHashingOutput(BlockDevice *target, qint64 capacity, qint64 dirtyLimit);
+
+    VCDiffHashingOutput &append(const char *s, size_t n) Q_DECL_OVERRIDE;
+    void clear() Q_DECL_OVERRIDE;
+    void push_back(char c) Q_DECL_OVERRIDE;
+    void ReserveAdditionalBytes(size_t n) Q_DECL_OVERRIDE;
+    size_t size() const Q_DECL_OVERRIDE { return (size_t) highWater; }
+
+    qint64 highWaterMark() const { return highWater; }
+    bool failed() const { return overflow || writeError; }
+    QByteArray result() { return hash.result(); }
+
+private:
+    BlockDevice *target;
+    qint64 capacity;
+    qint64 dirtyLimit;
+    qint64 highWater;
+    qint64 writebackStarted;
+    qint64 writebackDone;
+    bool overflow;
+    bool writeError;
+    Sha512 hash;
+};